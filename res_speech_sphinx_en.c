@@ -33,6 +33,12 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: $")
 #include <asterisk/frame.h>
 #include <asterisk/dsp.h>
 #include <asterisk/speech.h>
+#include <asterisk/cli.h>
+#include <asterisk/utils.h>
+#include <asterisk/lock.h>
+#include <asterisk/linkedlists.h>
+#include <asterisk/paths.h>
+#include <asterisk/manager.h>
 #include "speech_sphinx.h"
 
 /* Not sure how to handle TCP socket in *, so... */
@@ -46,6 +52,18 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: $")
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <math.h>
+#ifdef HAVE_POCKETSPHINX
+#include <pocketsphinx.h>
+#endif
+#ifdef HAVE_SPHINXBASE
+#include <sphinxbase/cmd_ln.h>
+#include <sphinxbase/fe.h>
+#endif
+#include <endian.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <limits.h>
 
 
  
@@ -55,14 +73,45 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: $")
 #define SPHINX_BUFSIZE 2048
 #define SPHINX_ERROR   0
 #define SPHINX_SUCCESS 1
+#define SPHINX_SHED    2
+
+#if __BYTE_ORDER == __BIG_ENDIAN
+#define SPHINX_HOST_ORDER SPHINX_ORDER_BIG
+#else
+#define SPHINX_HOST_ORDER SPHINX_ORDER_LITTLE
+#endif
+
+/*! \brief Bump a counter in this thread's slot of the session's backend */
+#define SPHINX_STAT(ss, field, n) do { \
+	if ((ss)->backend) \
+		__atomic_fetch_add(&sphinx_stat_slot((ss)->backend)->field, (n), __ATOMIC_RELAXED); \
+} while (0)
+
+/*! \brief Raise a high-water mark in this thread's slot, which other threads may share */
+#define SPHINX_STAT_HWM(ss, field, v) do { \
+	if ((ss)->backend) \
+		sphinx_stat_max(&sphinx_stat_slot((ss)->backend)->field, (v)); \
+} while (0)
+
+/*! \brief Size of a request header in the framing negotiated for ss */
+#define SPHINX_REQHDR_LEN(ss) ((ss)->proto ? SPHINX_REQHDR_V1 : sizeof(int) + sizeof(enum e_reqtype))
+
+/*! \brief Most feature frames one request can carry, flush frame included */
+#define SPHINX_FE_MAXFRAMES (SPHINX_BUFSIZE / 2 / SPHINX_FE_SHIFT + 3)
+
+/*! \brief Capabilities we advertise, features and datagrams only when configured */
+#define SPHINX_WANT_CAPS (SPHINX_CLIENT_CAPS | (SPHINX_FEATURES ? SPHINX_CAP_FEATURES : 0) | \
+						  (SPHINX_DATAGRAM ? SPHINX_CAP_DATAGRAM : 0))
 
 /* Functions used internally only */
 /*! \brief Logs the current state as a NOTICE */
 	 void log_state(struct ast_speech *speech);
 /*! \brief Establish socket connection to sphinx server */
-	 int sphinx_connect(struct ast_speech *speech, char const *host, const int port);
+	 int sphinx_connect(struct ast_speech *speech, struct sphinx_backend *be);
 /*! \brief Disconnect socket */
 	 int sphinx_disconnect(struct ast_speech *speech);
+/*! \brief send SLINEAR audio, as features when negotiated */
+	 int sphinx_send_audio(struct ast_speech *speech, void *data, int len, int silent);
 /*! \brief exchange packets with server */
 	 int sphinx_comm(struct sphinx_request *sr, struct ast_speech *speech, int catchup);
 /*! \brief clear all data */
@@ -77,6 +126,47 @@ ASTERISK_FILE_VERSION(__FILE__, "$Revision: $")
 	 int sphinx_sread(struct sphinx_state *ss, struct ast_speech *speech);
 /*! \brief Change state and log error */
 	 int make_error(struct ast_speech *speech, char *errmsg);
+/*! \brief apply overload policy until a request fits in the send buffer */
+	 int sphinx_make_room(struct sphinx_request *sr, struct ast_speech *speech);
+/*! \brief drop the oldest unsent silent frame from the send buffer */
+	 int sphinx_shed_silence(struct sphinx_state *ss);
+/*! \brief negotiate protocol version and capabilities */
+	 int sphinx_handshake(struct ast_speech *speech);
+/*! \brief encode a request header, returns its length */
+	 int sphinx_reqhdr(struct sphinx_state *ss, struct sphinx_request *sr, char *hdr);
+/*! \brief act on a complete response in rbuf */
+	 int sphinx_handle_response(struct sphinx_state *ss, struct ast_speech *speech);
+/*! \brief take a partial hypothesis from rbuf */
+	 int sphinx_handle_partial(struct sphinx_state *ss, struct ast_speech *speech);
+/*! \brief split the grammar a result came from off its text */
+	 int sphinx_result_grammar(struct sphinx_state *ss, const char **text, int *tlen,
+							   const char **grammar);
+/*! \brief store a result or partial as speech->results */
+	 int sphinx_set_result(struct ast_speech *speech, int score, const char *grammar,
+						   const char *text, int tlen);
+/*! \brief tell the server which grammars to listen for */
+	 int sphinx_send_grammars(struct ast_speech *speech);
+/*! \brief hand pending results over to the notifier thread */
+	 int sphinx_notify_register(struct ast_speech *speech);
+/*! \brief take a session back from the notifier thread */
+	 void sphinx_notify_unregister(struct sphinx_state *ss);
+/*! \brief final results are in, tell whoever is waiting */
+	 void sphinx_publish_result(struct ast_speech *speech);
+/*! \brief tell the server to drop the current utterance */
+	 int sphinx_cancel(struct ast_speech *speech);
+/*! \brief apply the session's socket profile */
+	 void sphinx_set_sockopts(struct sphinx_state *ss);
+/*! \brief wait a bounded time for sbuf to reach the socket */
+	 int sphinx_drain_writes(struct sphinx_state *ss, int ms);
+/*! \brief queue a request or response for the capture file */
+	 void sphinx_capture(struct sphinx_state *ss, int dir, unsigned int type,
+						 unsigned int seq, const char *data, int len);
+/*! \brief open a capture file for a new connection */
+	 void sphinx_capture_open(struct sphinx_state *ss);
+/*! \brief hand the capture file back to the writer for closing */
+	 void sphinx_capture_close(struct sphinx_state *ss);
+/*! \brief send the session's decoder settings again, to a new connection */
+	 int sphinx_tune_replay(struct ast_speech *speech);
 
 /*! \brief API description */
 	 static struct ast_speech_engine SPHINX_ENGINE_INFO = 
@@ -102,38 +192,3542 @@ int SPHINX_SERVER_PORT = 10070;
 int SPHINX_SILENCE_TIME = 200;
 int SPHINX_NOISE_FRAMES = 0;
 int SPHINX_SILENCE_THRESHOLD = 500;
+int SPHINX_OVERLOAD_POLICY = SPHINX_OVERLOAD_FAIL;
+int SPHINX_OVERLOAD_WAIT = 100;
+int SPHINX_HANDSHAKE = 0;
+int SPHINX_NOTIFY = 0;
+int SPHINX_CAPTURE = 0;
+char SPHINX_CAPTURE_DIR[PATH_MAX] = "";
+int SPHINX_CAPTURE_QUEUE = 1048576;
+int SPHINX_BULK_WORKERS = 4;
+int SPHINX_FEATURES = 0;
+int SPHINX_DATAGRAM = 0;
+int SPHINX_STABLE_FINISH = 0;
+int SPHINX_DEADLINE = 0;
+int SPHINX_DEADLINE_WAIT = 1000;
+char SPHINX_SERVERS[1024] = "";
+int SPHINX_ROUTE_LOAD = 125;
+int SPHINX_MAX_SESSIONS = 0;
+int SPHINX_ADMIT_QUEUE = 0;
+int SPHINX_ADMIT_WAIT = 500;
+int SPHINX_PRIORITY = SPHINX_PRIO_INTERACTIVE;
+int SPHINX_PRIORITY_WEIGHT = 4;
+char SPHINX_SHADOW_SERVER[256] = "";
+int SPHINX_SHADOW_RATE = 0;
+int SPHINX_SHADOW_QUEUE = 4096;
+int SPHINX_BREAKER_FAILURES = 5;
+int SPHINX_BREAKER_COOLDOWN = 10000;
+int SPHINX_PING_TIMEOUT = 1000;
+int SPHINX_LEARN_ENDPOINT = 0;
+int SPHINX_LEARN_MIN = 150;
+int SPHINX_LEARN_MAX = 1500;
+int SPHINX_LEARN_SAMPLES = 20;
+char SPHINX_LOCAL_GRAMMARS[1024] = "";
+char SPHINX_LOCAL_HMM[PATH_MAX] = "";
+char SPHINX_LOCAL_DICT[PATH_MAX] = "";
+char SPHINX_LOCAL_DIR[PATH_MAX] = "";
+int SPHINX_LOCAL_WORKERS = 2;
+int SPHINX_LOCAL_QUEUE = 32;
+struct sphinx_sockprofile SPHINX_SOCKPROFILE = { 0, SPHINX_CORK_NONE, 0, 0, 0, 0, 10, 3 };
 
+/*! \brief Names for circuit breaker states, indexed by enum e_breaker */
+static const char *breaker_names[] = { "closed", "open", "half-open" };
 
-/*! \brief set socket blocking mode */
-int sphinx_set_blocking(int s, int shouldblock)
+/*! \brief Names for cork, indexed by enum e_cork */
+static const char *cork_names[] = { "no", "msgmore", "cork" };
+
+/*! \brief Names for overloadpolicy, indexed by enum e_overload */
+static const char *overload_names[] = { "fail", "block", "drop", "finish" };
+
+/*! \brief Names for priority classes, indexed by enum e_priority */
+static const char *priority_names[] = { "interactive", "batch" };
+
+/*! \brief Class of the sessions this thread creates, -1 for the configured one */
+static __thread int create_priority = -1;
+
+/*! \brief Recognition servers */
+static struct sphinx_backend backends[SPHINX_MAX_BACKENDS];
+static int nbackends = 1;
+
+/*! \brief Grammar hash ring over the servers, sorted by hash; fixed once loaded */
+static struct sphinx_ring_point ring[SPHINX_MAX_BACKENDS * SPHINX_RING_VNODES];
+static int nring;
+
+/*! \brief Counter slot of the calling thread */
+static __thread int stat_slot = -1;
+static int stat_slots_used;
+
+static inline struct sphinx_counters *sphinx_stat_slot(struct sphinx_backend *be)
 {
-	int block = shouldblock ? 0 : O_NONBLOCK;
-	int sflags;
+	if (stat_slot < 0)
+		stat_slot = ast_atomic_fetchadd_int(&stat_slots_used, 1) % SPHINX_STAT_SLOTS;
+	return &be->stats[stat_slot];
+}
 
-	if ((sflags = fcntl(s, F_GETFL, 0)) == -1)
+/*! \brief Atomic *hwm = MAX(*hwm, v) */
+static inline void sphinx_stat_max(int *hwm, int v)
+{
+	int old = __atomic_load_n(hwm, __ATOMIC_RELAXED);
+
+	while (v > old && !__atomic_compare_exchange_n(hwm, &old, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*! \brief Add up every thread's counters for a backend */
+static void sphinx_stat_sum(struct sphinx_backend *be, struct sphinx_counters *sum)
+{
+	int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < SPHINX_STAT_SLOTS; i++) {
+		struct sphinx_counters *c = &be->stats[i];
+		sum->bytes_sent += c->bytes_sent;
+		sum->bytes_recv += c->bytes_recv;
+		sum->frames += c->frames;
+		sum->requests += c->requests;
+		sum->responses += c->responses;
+		sum->syscalls += c->syscalls;
+		sum->partial_writes += c->partial_writes;
+		sum->overflows += c->overflows;
+		sum->timeouts += c->timeouts;
+		sum->errors += c->errors;
+		if (c->pwbytes_hwm > sum->pwbytes_hwm)
+			sum->pwbytes_hwm = c->pwbytes_hwm;
+		if (c->rbufused_hwm > sum->rbufused_hwm)
+			sum->rbufused_hwm = c->rbufused_hwm;
+	}
+}
+
+/*! \brief Overload counters, shared by all sessions of this engine */
+static struct sphinx_overload_stats overload_stats;
+
+/*! \brief Result latency counters, shared by all sessions of this engine */
+static struct sphinx_latency_stats latency_stats;
+
+/*! \brief Result notifier: one thread reads final results for every waiting session */
+AST_MUTEX_DEFINE_STATIC(notify_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(notify_list, sphinx_state);
+static pthread_t notify_thread = AST_PTHREADT_NULL;
+static int notify_epfd = -1;
+static int notify_wakefd = -1;
+static int notify_stop;
+
+/*! \brief Capture writer: sessions queue records, one thread does the file I/O */
+struct capture_rec {
+	FILE *fp;					/* File to append to */
+	int close;					/* Last record for fp, close it */
+	int len;
+	AST_LIST_ENTRY(capture_rec) entry;
+	char data[0];
+};
+AST_MUTEX_DEFINE_STATIC(capture_lock);
+static ast_cond_t capture_cond;
+static AST_LIST_HEAD_NOLOCK_STATIC(capture_queue, capture_rec);
+static pthread_t capture_thread = AST_PTHREADT_NULL;
+static int capture_queued;		/* Bytes waiting in capture_queue */
+static int capture_dropped;		/* Records lost because the writer fell behind */
+static int capture_files;		/* Files opened, for unique names */
+static int capture_stop;
+
+
+/*! \brief store v as little-endian uint32 */
+static inline void sphinx_put32(char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/*! \brief load little-endian uint32 */
+static inline uint32_t sphinx_get32(const char *p)
+{
+	const unsigned char *u = (const unsigned char *) p;
+	return u[0] | (u[1] << 8) | (u[2] << 16) | ((uint32_t) u[3] << 24);
+}
+
+/*! \brief Guards the circuit breaker fields of every backend */
+AST_MUTEX_DEFINE_STATIC(breaker_lock);
+
+/*! \brief
+ * Application-level liveness check on a connection of its own: a HELLO in
+ * legacy framing, which any server answers.  A hung recognizer still accepts
+ * connections, so only an answer counts.
+ */
+static int sphinx_ping(struct sphinx_backend *be, int timeout)
+{
+	struct sockaddr_in sin;
+	struct hostent *hp;
+	struct ast_hostent ahp;
+	struct pollfd pfd;
+	struct timeval start = ast_tvnow();
+	char req[sizeof(int) + sizeof(enum e_reqtype) + 4 * sizeof(uint32_t)];
+	char resp[SPHINX_BUFSIZE];
+	int dlen = 4 * sizeof(uint32_t), got = 0, want = sizeof(int32_t), n, left, s;
+	enum e_reqtype rtype = REQTYPE_HELLO;
+
+	if ((hp = ast_gethostbyname(be->host, &ahp)) == NULL)
 		return SPHINX_ERROR;
-	if (fcntl(s, F_SETFL, sflags | block) == -1)
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0)
 		return SPHINX_ERROR;
+	sphinx_set_blocking(s, 0);
+
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(be->port);
+	memcpy(&sin.sin_addr, hp->h_addr, sizeof(sin.sin_addr));
+	if (connect(s, (struct sockaddr *) &sin, sizeof(sin)) && errno != EINPROGRESS)
+		goto fail;
+
+	memcpy(req, &dlen, sizeof(dlen));
+	memcpy(req + sizeof(dlen), &rtype, sizeof(rtype));
+	sphinx_put32(req + sizeof(dlen) + sizeof(rtype), SPHINX_PROTO_MAGIC);
+	sphinx_put32(req + sizeof(dlen) + sizeof(rtype) + 4, SPHINX_PROTO_VERSION);
+	sphinx_put32(req + sizeof(dlen) + sizeof(rtype) + 8, SPHINX_HOST_ORDER);
+	sphinx_put32(req + sizeof(dlen) + sizeof(rtype) + 12, 0);
+
+	pfd.fd = s;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, timeout) != 1 || (pfd.revents & (POLLERR | POLLHUP)) ||
+		write(s, req, sizeof(req)) != sizeof(req))
+		goto fail;
+
+	/* Length, then that much payload */
+	pfd.events = POLLIN;
+	while (got < want) {
+		if ((left = timeout - ast_tvdiff_ms(ast_tvnow(), start)) <= 0 ||
+			poll(&pfd, 1, left) != 1)
+			goto fail;
+		if ((n = read(s, resp + got, want - got)) <= 0)
+			goto fail;
+		got += n;
+		if (got == sizeof(int32_t) && want == sizeof(int32_t)) {
+			memcpy(&n, resp, sizeof(n));
+			if (n < 0 || n > sizeof(resp) - sizeof(int32_t))
+				goto fail;
+			want += n;
+		}
+	}
+	close(s);
 	return SPHINX_SUCCESS;
+
+fail:
+	close(s);
+	return SPHINX_ERROR;
 }
 
-/*! \brief load module, config settings */
-static int load_module(void)
+/*! \brief Count a failure (ok 0) or success of a session on be */
+static void sphinx_breaker_report(struct sphinx_backend *be, int ok)
 {
-	struct ast_flags config_flags = { 0 };
-	struct ast_config *conf = ast_config_load("sphinx_en.conf", config_flags);
-	char const *value;
+	if (be == NULL || !SPHINX_BREAKER_FAILURES)
+		return;
 
-	if (conf == NULL) {
-		ast_log(LOG_ERROR, "Unable to load sphinx.conf\n");
-		return AST_MODULE_LOAD_FAILURE;
+	ast_mutex_lock(&breaker_lock);
+	if (ok) {
+		be->failures = 0;
+	} else if (++be->failures >= SPHINX_BREAKER_FAILURES && be->breaker == SPHINX_BREAKER_CLOSED) {
+		be->breaker = SPHINX_BREAKER_OPEN;
+		be->opened = ast_tvnow();
+		ast_log(LOG_WARNING, "Sphinx server %s:%d failed %d times in a row, failing new sessions fast\n",
+				be->host, be->port, be->failures);
+	}
+	ast_mutex_unlock(&breaker_lock);
+}
+
+/*! \brief
+ * May a new session use be?  Once the cooldown is over the first caller pings
+ * the server; everyone else keeps failing fast until the ping settles it.
+ */
+static int sphinx_breaker_allow(struct sphinx_backend *be)
+{
+	int probe = 0, ok;
+
+	ast_mutex_lock(&breaker_lock);
+	if (be->breaker == SPHINX_BREAKER_CLOSED) {
+		ast_mutex_unlock(&breaker_lock);
+		return 1;
+	}
+	if (be->breaker == SPHINX_BREAKER_OPEN &&
+		ast_tvdiff_ms(ast_tvnow(), be->opened) >= SPHINX_BREAKER_COOLDOWN) {
+		be->breaker = SPHINX_BREAKER_HALFOPEN;
+		probe = 1;
+	}
+	if (!probe)
+		be->rejected++;
+	ast_mutex_unlock(&breaker_lock);
+	if (!probe)
+		return 0;
+
+	ok = sphinx_ping(be, SPHINX_PING_TIMEOUT) == SPHINX_SUCCESS;
+
+	ast_mutex_lock(&breaker_lock);
+	if (ok) {
+		be->breaker = SPHINX_BREAKER_CLOSED;
+		be->failures = 0;
+		ast_log(LOG_NOTICE, "Sphinx server %s:%d answers again\n", be->host, be->port);
+	} else {
+		be->breaker = SPHINX_BREAKER_OPEN;
+		be->opened = ast_tvnow();
+		be->rejected++;
+	}
+	ast_mutex_unlock(&breaker_lock);
+	return ok;
+}
+
+/*! \brief FNV-1a, finished with a mix so nearby names spread over the ring */
+static uint32_t sphinx_hash(const char *s)
+{
+	uint32_t h = 2166136261u;
+
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= 16777619u;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
+
+static int sphinx_ring_cmp(const void *a, const void *b)
+{
+	const struct sphinx_ring_point *pa = a, *pb = b;
+
+	return pa->hash < pb->hash ? -1 : pa->hash > pb->hash;
+}
+
+/*! \brief Place every server on the ring, SPHINX_RING_VNODES times each */
+static void sphinx_ring_build(void)
+{
+	char key[300];
+	int i, j;
+
+	nring = 0;
+	for (i = 0; i < nbackends; i++) {
+		for (j = 0; j < SPHINX_RING_VNODES; j++) {
+			snprintf(key, sizeof(key), "%s:%d#%d", backends[i].host, backends[i].port, j);
+			ring[nring].hash = sphinx_hash(key);
+			ring[nring].backend = i;
+			nring++;
+		}
+	}
+	qsort(ring, nring, sizeof(ring[0]), sphinx_ring_cmp);
+}
+
+/*! \brief
+ * Pick a server for a session.  A grammar goes to the first server clockwise
+ * from its hash on the ring, so each grammar stays hot on few servers; one
+ * already holding more than routeload% of an even share of the sessions is
+ * passed over for the next, which bounds the load any grammar can pile on a
+ * server.  Without a grammar the least loaded server is taken.  Servers in
+ * skip, or whose breaker is open, are never picked.  Returns an index or -1.
+ */
+static int sphinx_route(const char *grammar, unsigned int skip)
+{
+	unsigned int seen;
+	int i, k, lo, hi, owner, total = 0, cap, pass;
+	uint32_t h;
+
+	for (i = 0; i < nbackends; i++)
+		total += backends[i].sessions;
+
+	if (ast_strlen_zero(grammar)) {
+		for (;;) {
+			k = -1;
+			for (i = 0; i < nbackends; i++) {
+				if (!(skip & (1u << i)) && (k < 0 || backends[i].sessions < backends[k].sessions))
+					k = i;
+			}
+			if (k < 0 || sphinx_breaker_allow(&backends[k]))
+				return k;
+			skip |= 1u << k;
+		}
+	}
+
+	/* First ring point at or after the grammar's hash */
+	h = sphinx_hash(grammar);
+	lo = 0;
+	hi = nring;
+	while (lo < hi) {
+		k = (lo + hi) / 2;
+		if (ring[k].hash < h)
+			lo = k + 1;
+		else
+			hi = k;
+	}
+	owner = ring[lo % nring].backend;
+	cap = ((total + 1) * SPHINX_ROUTE_LOAD + 100 * nbackends - 1) / (100 * nbackends);
+
+	/* Within the load bound first; if every server is past it, the ring order alone */
+	for (pass = 0; pass < 2; pass++) {
+		seen = skip;
+		for (k = 0; k < nring; k++) {
+			i = ring[(lo + k) % nring].backend;
+			if (seen & (1u << i))
+				continue;
+			seen |= 1u << i;
+			if (!pass && backends[i].sessions >= cap)
+				continue;
+			if (!sphinx_breaker_allow(&backends[i])) {
+				skip |= 1u << i;
+				continue;
+			}
+			ast_atomic_fetchadd_int(&backends[i].routed, 1);
+			if (i != owner)
+				ast_atomic_fetchadd_int(&backends[i].spilled, 1);
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*! \brief
+ * Connect the session to the server sphinx_route() picks for grammar, trying
+ * the next pick when one cannot be reached.  Staying put costs nothing.
+ */
+static int sphinx_connect_routed(struct ast_speech *speech, const char *grammar)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	unsigned int skip = 0;
+	int i;
+
+	while ((i = sphinx_route(grammar, skip)) >= 0) {
+		if (ss->s && ss->backend == &backends[i])
+			return SPHINX_SUCCESS;
+		if (sphinx_connect(speech, &backends[i]) == SPHINX_SUCCESS)
+			return SPHINX_SUCCESS;
+		sphinx_breaker_report(&backends[i], 0);
+		skip |= 1u << i;
+	}
+	return SPHINX_ERROR;
+}
+
+/*! \brief Admission control counters */
+static struct {
+	int active;					/* Sessions holding a slot */
+	int waiting;				/* Sessions queued for one */
+	int waiting_hwm;
+	int admitted;
+	int queued;					/* Had to wait, admitted or not */
+	int waited;					/* Admitted after waiting */
+	int rejected;				/* Queue was full */
+	int timedout;				/* Waited admitwait ms in vain */
+	int byclass[SPHINX_PRIO_CLASSES];	/* Admitted, per class */
+} admit_stats;
+
+AST_MUTEX_DEFINE_STATIC(admit_lock);
+static ast_cond_t admit_cond;
+static int admit_waiting[SPHINX_PRIO_CLASSES];	/* Queued sessions, per class */
+static int admit_grants[SPHINX_PRIO_CLASSES];	/* Freed slots handed to a class, not yet taken */
+static int admit_turns;
+
+/*! \brief
+ * Weighted round robin between the classes with someone waiting: interactive
+ * first, until it has had priorityweight turns while batch waited; then batch
+ * gets one.  *turns counts those turns.  Returns the class, -1 if none waits.
+ */
+static int sphinx_prio_next(const int *want, int *turns)
+{
+	if (want[SPHINX_PRIO_INTERACTIVE] > 0 &&
+		(want[SPHINX_PRIO_BATCH] <= 0 || *turns < SPHINX_PRIORITY_WEIGHT)) {
+		if (want[SPHINX_PRIO_BATCH] > 0)
+			(*turns)++;
+		return SPHINX_PRIO_INTERACTIVE;
+	}
+	if (want[SPHINX_PRIO_BATCH] > 0) {
+		*turns = 0;
+		return SPHINX_PRIO_BATCH;
+	}
+	return -1;
+}
+
+/*! \brief
+ * Take one of maxsessions for a new session.  When none is free, wait up to
+ * admitwait ms among at most admitqueue others; past that the session is
+ * refused, so SpeechCreate fails at once and the dialplan can fall back to
+ * DTMF while the sessions already running keep their server time.  Freed
+ * slots go to the waiters by priority class, see sphinx_prio_next().
+ */
+static int sphinx_admit(int prio)
+{
+	struct timeval tv;
+	struct timespec ts;
+	int res = 0;
+
+	ast_mutex_lock(&admit_lock);
+	if (!SPHINX_MAX_SESSIONS || (admit_stats.active < SPHINX_MAX_SESSIONS && !admit_stats.waiting)) {
+		admit_stats.active++;
+		admit_stats.admitted++;
+		admit_stats.byclass[prio]++;
+		ast_mutex_unlock(&admit_lock);
+		return 1;
+	}
+	if (admit_stats.waiting >= SPHINX_ADMIT_QUEUE) {
+		admit_stats.rejected++;
+		ast_mutex_unlock(&admit_lock);
+		return 0;
+	}
+
+	admit_stats.waiting++;
+	admit_waiting[prio]++;
+	admit_stats.queued++;
+	if (admit_stats.waiting > admit_stats.waiting_hwm)
+		admit_stats.waiting_hwm = admit_stats.waiting;
+	tv = ast_tvadd(ast_tvnow(), ast_samp2tv(SPHINX_ADMIT_WAIT, 1000));
+	ts.tv_sec = tv.tv_sec;
+	ts.tv_nsec = tv.tv_usec * 1000;
+	while (!admit_grants[prio]) {
+		if (ast_cond_timedwait(&admit_cond, &admit_lock, &ts) == ETIMEDOUT)
+			break;
+	}
+	admit_stats.waiting--;
+	admit_waiting[prio]--;
+	/* A slot granted to the class is still counted in active; take it even at the deadline */
+	if (admit_grants[prio]) {
+		admit_grants[prio]--;
+		admit_stats.admitted++;
+		admit_stats.waited++;
+		admit_stats.byclass[prio]++;
+		res = 1;
+	} else {
+		admit_stats.timedout++;
+	}
+	ast_mutex_unlock(&admit_lock);
+	return res;
+}
+
+/*! \brief Pass a session's slot on to a waiting class, or free it */
+static void sphinx_admit_release(struct sphinx_state *ss)
+{
+	int want[SPHINX_PRIO_CLASSES], i;
+
+	if (!ss->admitted)
+		return;
+	ss->admitted = 0;
+	ast_mutex_lock(&admit_lock);
+	for (i = 0; i < SPHINX_PRIO_CLASSES; i++)
+		want[i] = admit_waiting[i] - admit_grants[i];
+	if ((i = sphinx_prio_next(want, &admit_turns)) >= 0) {
+		admit_grants[i]++;
+		ast_cond_broadcast(&admit_cond);
+	} else {
+		admit_stats.active--;
+	}
+	ast_mutex_unlock(&admit_lock);
+}
+
+/*! \brief
+ * Is an idle connection still usable?  Catches a server that closed or reset
+ * it, or that TCP keepalive has given up on, before a prompt is sent down it.
+ */
+static int sphinx_alive(struct sphinx_state *ss)
+{
+	struct pollfd pfd = { ss->s, POLLIN | POLLRDHUP, 0 };
+	char c;
+
+	if (poll(&pfd, 1, 0) < 0)
+		return 0;
+	if (pfd.revents & (POLLERR | POLLHUP | POLLRDHUP | POLLNVAL))
+		return 0;
+	/* Unread answers are fine; end of file is not */
+	if ((pfd.revents & POLLIN) && recv(ss->s, &c, 1, MSG_PEEK) == 0)
+		return 0;
+	return 1;
+}
+
+/*! \brief
+ * Socket layer under sphinx_sread() and sphinx_swrite().  Normally a thin
+ * wrapper; 'sphinx en faults' swaps in one that misbehaves on purpose.
+ */
+struct sphinx_io {
+	ssize_t (*read)(struct sphinx_state *ss, void *buf, size_t len);
+	ssize_t (*send)(struct sphinx_state *ss, const void *buf, size_t len, int flags);
+};
+
+static ssize_t sphinx_io_read(struct sphinx_state *ss, void *buf, size_t len)
+{
+	return read(ss->s, buf, len);
+}
+
+static ssize_t sphinx_io_send(struct sphinx_state *ss, const void *buf, size_t len, int flags)
+{
+	return send(ss->s, buf, len, flags);
+}
+
+static const struct sphinx_io sphinx_io_plain = { sphinx_io_read, sphinx_io_send };
+
+/*! \brief Faults injected and what they did */
+static struct sphinx_faults fault_cfg;
+static struct {
+	int calls;
+	int fragmented;
+	int short_writes;
+	int eagains;
+	int delayed;
+	int resets;
+	int lost;					/* Datagrams dropped */
+	int reordered;				/* Datagrams held back */
+} fault_stats;
+
+/*! \brief Audio datagrams */
+static struct {
+	int sent;
+	int dropped;				/* Kernel had no room, lost like on the network */
+	int fallbacks;				/* Sessions put back on the stream by an error */
+} dgram_stats;
+
+/*! \brief Sleep, fail or shrink len as configured; returns -1 with errno set to fail the call */
+static int sphinx_fault(struct sphinx_state *ss, size_t *len, int writing)
+{
+	struct sphinx_faults f = fault_cfg;
+
+	ast_atomic_fetchadd_int(&fault_stats.calls, 1);
+	if (f.delay || f.jitter) {
+		usleep(1000 * (f.delay + (f.jitter ? ast_random() % (f.jitter + 1) : 0)));
+		ast_atomic_fetchadd_int(&fault_stats.delayed, 1);
+	}
+	if (f.reset && ast_random() % 1000000 < f.reset) {
+		shutdown(ss->s, SHUT_RDWR);
+		ast_atomic_fetchadd_int(&fault_stats.resets, 1);
+		errno = ECONNRESET;
+		return -1;
+	}
+	if (ss->storm || (f.eagain && ast_random() % 100 < f.eagain)) {
+		ss->storm = ss->storm ? ss->storm - 1 : f.storm;
+		ast_atomic_fetchadd_int(&fault_stats.eagains, 1);
+		errno = EAGAIN;
+		return -1;
+	}
+	if (f.fragment && *len > f.fragment) {
+		*len = f.fragment;
+		ast_atomic_fetchadd_int(&fault_stats.fragmented, 1);
+	}
+	if (writing && *len > 1 && f.shortwrite && ast_random() % 100 < f.shortwrite) {
+		*len = 1 + ast_random() % (*len - 1);
+		ast_atomic_fetchadd_int(&fault_stats.short_writes, 1);
+	}
+	return 0;
+}
+
+static ssize_t sphinx_faulty_read(struct sphinx_state *ss, void *buf, size_t len)
+{
+	if (sphinx_fault(ss, &len, 0))
+		return -1;
+	return read(ss->s, buf, len);
+}
+
+static ssize_t sphinx_faulty_send(struct sphinx_state *ss, const void *buf, size_t len, int flags)
+{
+	if (sphinx_fault(ss, &len, 1))
+		return -1;
+	return send(ss->s, buf, len, flags);
+}
+
+static const struct sphinx_io sphinx_io_faulty = { sphinx_faulty_read, sphinx_faulty_send };
+
+static const struct sphinx_io *sphinx_io = &sphinx_io_plain;
+
+/*! \brief
+ * In-process decoding.  Utterances for grammars listed in localgrammars are
+ * collected in the session and decoded whole by a small pool of pocketsphinx
+ * workers, each with every local grammar loaded, instead of going to the
+ * server.  Without pocketsphinx at build time every grammar is remote.
+ */
+struct sphinx_local_job {
+	struct ast_speech *speech;	/* Owner, until it cancels the job */
+	int16_t *audio;				/* The utterance, owned by the job */
+	int samples;
+	char grammar[64];
+	int priority;				/* Its session's enum e_priority */
+	int running;				/* A worker has it */
+	int cancelled;				/* Owner no longer wants the result */
+	AST_LIST_ENTRY(sphinx_local_job) list;
+};
+
+/*! \brief Longest utterance collected for local decoding, samples */
+#define SPHINX_LOCAL_MAXSAMPLES (8000 * 10)
+/*! \brief Silence kept ahead of speech for the local decoder, samples */
+#define SPHINX_LOCAL_PREROLL (8000 / 2)
+
+/*! \brief Local decoding counters */
+static struct {
+	int decoded;
+	int failed;
+	int rejected;				/* Queue was full */
+	int cancelled;
+	int total_ms;				/* Time spent decoding */
+} local_stats;
+
+AST_MUTEX_DEFINE_STATIC(local_lock);
+static ast_cond_t local_cond;
+static AST_LIST_HEAD_NOLOCK_STATIC(local_queue, sphinx_local_job);
+static int local_queued;
+#ifdef HAVE_POCKETSPHINX
+static int local_waiting[SPHINX_PRIO_CLASSES];	/* Queued jobs, per class */
+static int local_turns;
+#endif
+static int local_stop;
+static int local_running;		/* Workers started */
+static pthread_t *local_threads;
+
+/*! \brief Is grammar one of localgrammars? */
+static int sphinx_local_has(const char *grammar)
+{
+#ifdef HAVE_POCKETSPHINX
+	char list[sizeof(SPHINX_LOCAL_GRAMMARS)], *p = list, *name;
+
+	if (!local_running || ast_strlen_zero(grammar))
+		return 0;
+	ast_copy_string(list, SPHINX_LOCAL_GRAMMARS, sizeof(list));
+	while ((name = strsep(&p, ","))) {
+		if (!strcmp(ast_strip(name), grammar))
+			return 1;
+	}
+#endif
+	return 0;
+}
+
+/*! \brief
+ * Withdraw a session's job; a worker decoding it drops the result.  Callers
+ * may or may not hold speech->lock (sphinx_destroy does not), so ss->ljob is
+ * only read under local_lock: a worker publishing a result holds local_lock
+ * until it is done with the session, and clears ss->ljob before letting go.
+ */
+static void sphinx_local_cancel(struct sphinx_state *ss)
+{
+	struct sphinx_local_job *job;
+
+	ast_mutex_lock(&local_lock);
+	if ((job = ss->ljob) == NULL) {
+		ast_mutex_unlock(&local_lock);
+		return;
+	}
+	if (job->running) {
+		job->cancelled = 1;
+	} else {
+		AST_LIST_REMOVE(&local_queue, job, list);
+		local_queued--;
+#ifdef HAVE_POCKETSPHINX
+		local_waiting[job->priority]--;
+#endif
+		ast_free(job->audio);
+		ast_free(job);
+	}
+	ss->ljob = NULL;
+	ast_mutex_unlock(&local_lock);
+	ast_atomic_fetchadd_int(&local_stats.cancelled, 1);
+}
+
+/*! \brief
+ * Collect audio for the local decoder; an empty write ends the utterance and
+ * queues it.  Results arrive through sphinx_publish_result() like remote ones.
+ */
+static int sphinx_local_audio(struct ast_speech *speech, void *data, int len, int silent)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct sphinx_local_job *job;
+	int n = len / 2;
+
+	if (ss->final)
+		return SPHINX_SUCCESS;
+
+	if (n) {
+		if (ss->lbuf == NULL && (ss->lbuf = ast_malloc(SPHINX_LOCAL_MAXSAMPLES * sizeof(int16_t))) == NULL)
+			return SPHINX_ERROR;
+		n = MIN(n, SPHINX_LOCAL_MAXSAMPLES - ss->lsamples);
+		memcpy(ss->lbuf + ss->lsamples, data, n * sizeof(int16_t));
+		ss->lsamples += n;
+		if (silent && ss->lsamples > SPHINX_LOCAL_PREROLL) {
+			memmove(ss->lbuf, ss->lbuf + ss->lsamples - SPHINX_LOCAL_PREROLL,
+					SPHINX_LOCAL_PREROLL * sizeof(int16_t));
+			ss->lsamples = SPHINX_LOCAL_PREROLL;
+		}
+		if (ss->lsamples < SPHINX_LOCAL_MAXSAMPLES)
+			return SPHINX_SUCCESS;
+		/* Full, take what we have */
+	}
+
+	ss->final = 1;
+	ast_speech_change_state(speech, AST_SPEECH_STATE_WAIT);
+
+	if ((job = ast_calloc(1, sizeof(*job))) == NULL)
+		return SPHINX_ERROR;
+	job->speech = speech;
+	job->audio = ss->lbuf;
+	job->samples = ss->lsamples;
+	ast_copy_string(job->grammar, ss->grammars[0], sizeof(job->grammar));
+	job->priority = ss->priority;
+	ss->lbuf = NULL;
+	ss->lsamples = 0;
+
+	ast_mutex_lock(&local_lock);
+	if (local_queued >= SPHINX_LOCAL_QUEUE) {
+		ast_mutex_unlock(&local_lock);
+		ast_atomic_fetchadd_int(&local_stats.rejected, 1);
+		ast_log(LOG_WARNING, "Local decoder queue is full, no result for this utterance\n");
+		ast_free(job->audio);
+		ast_free(job);
+		sphinx_publish_result(speech);
+		return SPHINX_SUCCESS;
+	}
+	AST_LIST_INSERT_TAIL(&local_queue, job, list);
+	local_queued++;
+#ifdef HAVE_POCKETSPHINX
+	local_waiting[job->priority]++;
+#endif
+	ss->ljob = job;
+	ast_cond_signal(&local_cond);
+	ast_mutex_unlock(&local_lock);
+
+	return SPHINX_SUCCESS;
+}
+
+#ifdef HAVE_POCKETSPHINX
+/*! \brief A decoder with every local grammar loaded as a search of the same name */
+static ps_decoder_t *sphinx_local_decoder(void)
+{
+	char list[sizeof(SPHINX_LOCAL_GRAMMARS)], *p = list, *name, path[PATH_MAX];
+	cmd_ln_t *config;
+	ps_decoder_t *ps;
+
+	config = cmd_ln_init(NULL, ps_args(), TRUE, "-hmm", SPHINX_LOCAL_HMM, "-dict", SPHINX_LOCAL_DICT,
+						 "-samprate", "8000", "-nfft", "256", "-logfn", "/dev/null", NULL);
+	if (config == NULL)
+		return NULL;
+	ps = ps_init(config);
+	cmd_ln_free_r(config);
+	if (ps == NULL)
+		return NULL;
+
+	ast_copy_string(list, SPHINX_LOCAL_GRAMMARS, sizeof(list));
+	while ((name = strsep(&p, ","))) {
+		name = ast_strip(name);
+		if (ast_strlen_zero(name))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s.gram", SPHINX_LOCAL_DIR, name);
+		if (ps_set_jsgf_file(ps, name, path)) {
+			ast_log(LOG_ERROR, "Cannot load local grammar %s\n", path);
+			ps_free(ps);
+			return NULL;
+		}
+	}
+	return ps;
+}
+
+/*! \brief Local decoder worker */
+static void *sphinx_local_thread(void *data)
+{
+	ps_decoder_t *ps = data;
+	struct sphinx_local_job *job;
+	struct sphinx_state *ss;
+	struct timeval start;
+	const char *hyp;
+	int32 score;
+	int ok, prio;
+
+	for (;;) {
+		ast_mutex_lock(&local_lock);
+		while (!local_stop && AST_LIST_EMPTY(&local_queue))
+			ast_cond_wait(&local_cond, &local_lock);
+		if (local_stop) {
+			ast_mutex_unlock(&local_lock);
+			break;
+		}
+		/* Oldest job of the class whose turn it is */
+		prio = sphinx_prio_next(local_waiting, &local_turns);
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&local_queue, job, list) {
+			if (job->priority == prio) {
+				AST_LIST_REMOVE_CURRENT(list);
+				break;
+			}
+		}
+		AST_LIST_TRAVERSE_SAFE_END;
+		local_queued--;
+		local_waiting[prio]--;
+		job->running = 1;
+		ast_mutex_unlock(&local_lock);
+
+		start = ast_tvnow();
+		hyp = NULL;
+		ok = !ps_set_search(ps, job->grammar) && !ps_start_utt(ps) &&
+			ps_process_raw(ps, job->audio, job->samples, FALSE, TRUE) >= 0 && !ps_end_utt(ps);
+		if (ok)
+			hyp = ps_get_hyp(ps, &score);
+		ast_atomic_fetchadd_int(&local_stats.total_ms, ast_tvdiff_ms(ast_tvnow(), start));
+		ast_atomic_fetchadd_int(ok ? &local_stats.decoded : &local_stats.failed, 1);
+
+		/*
+		 * The owner may be waiting on us with speech->lock held, so never block
+		 * on it.  local_lock stays held until the result is published, so that
+		 * sphinx_local_cancel() in sphinx_destroy() cannot return, and free the
+		 * session, while we are still writing to it.
+		 */
+		for (;;) {
+			ast_mutex_lock(&local_lock);
+			if (job->cancelled) {
+				ast_mutex_unlock(&local_lock);
+				break;
+			}
+			if (!ast_mutex_trylock(&job->speech->lock)) {
+				ss = (struct sphinx_state *) job->speech->data;
+				ss->ljob = NULL;
+				if (hyp != NULL)
+					sphinx_set_result(job->speech, score, job->grammar, hyp, strlen(hyp));
+				ast_log(LOG_NOTICE, "Local score: %d Grammar: %s Result: '%s'\n", hyp ? score : 0,
+						job->grammar, S_OR(hyp, ""));
+				sphinx_publish_result(job->speech);
+				ast_mutex_unlock(&job->speech->lock);
+				ast_mutex_unlock(&local_lock);
+				break;
+			}
+			ast_mutex_unlock(&local_lock);
+			usleep(1000);
+		}
+		ast_free(job->audio);
+		ast_free(job);
+	}
+
+	ps_free(ps);
+	return NULL;
+}
+#endif
+
+/*! \brief Start the local decoder pool, if anything is configured for it */
+static int sphinx_local_start(void)
+{
+#ifdef HAVE_POCKETSPHINX
+	ps_decoder_t *ps;
+	int i;
+
+	if (ast_strlen_zero(SPHINX_LOCAL_GRAMMARS))
+		return SPHINX_SUCCESS;
+	if ((local_threads = ast_calloc(SPHINX_LOCAL_WORKERS, sizeof(*local_threads))) == NULL)
+		return SPHINX_ERROR;
+	ast_cond_init(&local_cond, NULL);
+	local_stop = 0;
+	for (i = 0; i < SPHINX_LOCAL_WORKERS; i++) {
+		if ((ps = sphinx_local_decoder()) == NULL)
+			break;
+		if (ast_pthread_create_background(&local_threads[i], NULL, sphinx_local_thread, ps)) {
+			ps_free(ps);
+			break;
+		}
+		local_running++;
+	}
+	return local_running ? SPHINX_SUCCESS : SPHINX_ERROR;
+#else
+	if (!ast_strlen_zero(SPHINX_LOCAL_GRAMMARS))
+		ast_log(LOG_WARNING, "Built without pocketsphinx, localgrammars are decoded by the server\n");
+	return SPHINX_SUCCESS;
+#endif
+}
+
+/*! \brief Stop the local decoder pool; queued jobs were cancelled with their sessions */
+static void sphinx_local_stop(void)
+{
+	int i;
+
+	if (!local_running)
+		return;
+	ast_mutex_lock(&local_lock);
+	local_stop = 1;
+	ast_cond_broadcast(&local_cond);
+	ast_mutex_unlock(&local_lock);
+	for (i = 0; i < local_running; i++)
+		pthread_join(local_threads[i], NULL);
+	local_running = 0;
+	ast_free(local_threads);
+	local_threads = NULL;
+	ast_cond_destroy(&local_cond);
+}
+
+/*! \brief Learned endpoints, one entry per grammar seen */
+AST_MUTEX_DEFINE_STATIC(endpoint_lock);
+static AST_LIST_HEAD_NOLOCK_STATIC(endpoint_list, sphinx_endpoint_stats);
+static int endpoint_dirty;
+
+/*! \brief Stats for a grammar, created on first use; call with endpoint_lock held */
+static struct sphinx_endpoint_stats *sphinx_endpoint_find(const char *grammar, int create)
+{
+	struct sphinx_endpoint_stats *es;
+
+	AST_LIST_TRAVERSE(&endpoint_list, es, list) {
+		if (!strcmp(es->grammar, grammar))
+			return es;
+	}
+	if (!create || (es = ast_calloc(1, sizeof(*es))) == NULL)
+		return NULL;
+	ast_copy_string(es->grammar, grammar, sizeof(es->grammar));
+	AST_LIST_INSERT_TAIL(&endpoint_list, es, list);
+	return es;
+}
+
+/*! \brief Pause length below which a share of the utterances fall, from the histogram */
+static int sphinx_endpoint_percentile(struct sphinx_endpoint_stats *es, int percent)
+{
+	int i, seen = 0;
+
+	for (i = 0; i < SPHINX_PAUSE_BUCKETS; i++) {
+		seen += es->hist[i];
+		if (seen * 100 >= es->utterances * percent)
+			return (i + 1) * SPHINX_PAUSE_BUCKET;
+	}
+	return SPHINX_PAUSE_BUCKETS * SPHINX_PAUSE_BUCKET;
+}
+
+/*! \brief
+ * The endpoint must outlast the pauses people make mid-answer: the 95th
+ * percentile of the longest one per utterance, plus a quarter for headroom,
+ * kept within learnmin and learnmax.  Call with endpoint_lock held.
+ */
+static void sphinx_endpoint_derive(struct sphinx_endpoint_stats *es)
+{
+	int ms;
+
+	if (es->utterances < SPHINX_LEARN_SAMPLES) {
+		es->endpoint = 0;
+		return;
+	}
+	ms = sphinx_endpoint_percentile(es, 95) * 5 / 4;
+	es->endpoint = MAX(SPHINX_LEARN_MIN, MIN(SPHINX_LEARN_MAX, ms));
+}
+
+static void sphinx_endpoint_save(void);
+
+/*! \brief Learn from an utterance of grammar that ended on silence */
+static void sphinx_endpoint_learn(const char *grammar, int maxpause, int speech_ms)
+{
+	struct sphinx_endpoint_stats *es;
+	int save;
+
+	if (ast_strlen_zero(grammar))
+		return;
+	ast_mutex_lock(&endpoint_lock);
+	if ((es = sphinx_endpoint_find(grammar, 1)) != NULL) {
+		es->hist[MIN(maxpause / SPHINX_PAUSE_BUCKET, SPHINX_PAUSE_BUCKETS - 1)]++;
+		es->utterances++;
+		es->speech_ms += speech_ms;
+		sphinx_endpoint_derive(es);
+		endpoint_dirty++;
+	}
+	if ((save = endpoint_dirty >= 100))
+		endpoint_dirty = 0;
+	ast_mutex_unlock(&endpoint_lock);
+
+	/* Now and then, so a crash does not lose it all */
+	if (save)
+		sphinx_endpoint_save();
+}
+
+/*! \brief
+ * Silence timeout for the next utterance of grammar, 0 for the configured
+ * one.  Every tenth utterance gets learnmax instead, so pauses longer than
+ * the learned timeout are still seen and it cannot only ever shrink.
+ */
+static int sphinx_endpoint_get(const char *grammar)
+{
+	struct sphinx_endpoint_stats *es;
+	int ms = 0;
+
+	if (!SPHINX_LEARN_ENDPOINT || ast_strlen_zero(grammar))
+		return 0;
+	ast_mutex_lock(&endpoint_lock);
+	if ((es = sphinx_endpoint_find(grammar, 0)) != NULL)
+		ms = es->endpoint;
+	ast_mutex_unlock(&endpoint_lock);
+	if (ms && ast_random() % 10 == 0)
+		ms = SPHINX_LEARN_MAX;
+	return ms;
+}
+
+/*! \brief Where learned endpoints are kept between restarts */
+static void sphinx_endpoint_path(char *path, size_t len)
+{
+	snprintf(path, len, "%s/sphinx_en_endpoints", ast_config_AST_DATA_DIR);
+}
+
+/*! \brief Write learned endpoints out, one line per grammar: name, utterances, ms, histogram */
+static void sphinx_endpoint_save(void)
+{
+	struct sphinx_endpoint_stats *es;
+	char path[PATH_MAX], tmp[PATH_MAX + 4];
+	FILE *fp;
+	int i;
+
+	sphinx_endpoint_path(path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.new", path);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		ast_log(LOG_WARNING, "Cannot save learned endpoints to %s: %s\n", tmp, strerror(errno));
+		return;
+	}
+	ast_mutex_lock(&endpoint_lock);
+	AST_LIST_TRAVERSE(&endpoint_list, es, list) {
+		fprintf(fp, "%s %d %lld", es->grammar, es->utterances, es->speech_ms);
+		for (i = 0; i < SPHINX_PAUSE_BUCKETS; i++)
+			fprintf(fp, " %d", es->hist[i]);
+		fputc('\n', fp);
+	}
+	ast_mutex_unlock(&endpoint_lock);
+	if (fclose(fp) || rename(tmp, path))
+		ast_log(LOG_WARNING, "Cannot save learned endpoints to %s: %s\n", path, strerror(errno));
+}
+
+/*! \brief Read back what sphinx_endpoint_save() wrote */
+static void sphinx_endpoint_load(void)
+{
+	struct sphinx_endpoint_stats *es;
+	char path[PATH_MAX], line[1024], grammar[64], *p;
+	FILE *fp;
+	int i, n, utterances;
+	long long speech_ms;
+
+	sphinx_endpoint_path(path, sizeof(path));
+	if ((fp = fopen(path, "r")) == NULL)
+		return;
+	ast_mutex_lock(&endpoint_lock);
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%63s %d %lld%n", grammar, &utterances, &speech_ms, &n) != 3 ||
+			(es = sphinx_endpoint_find(grammar, 1)) == NULL)
+			continue;
+		es->utterances = utterances;
+		es->speech_ms = speech_ms;
+		for (i = 0, p = line + n; i < SPHINX_PAUSE_BUCKETS; i++, p += n) {
+			if (sscanf(p, "%d%n", &es->hist[i], &n) != 1)
+				break;
+		}
+		sphinx_endpoint_derive(es);
+	}
+	ast_mutex_unlock(&endpoint_lock);
+	fclose(fp);
+}
+
+/*! \brief Forget everything learned */
+static void sphinx_endpoint_free(void)
+{
+	struct sphinx_endpoint_stats *es;
+
+	ast_mutex_lock(&endpoint_lock);
+	while ((es = AST_LIST_REMOVE_HEAD(&endpoint_list, list)))
+		ast_free(es);
+	ast_mutex_unlock(&endpoint_lock);
+}
+
+/*! \brief Front end tables, filled once by sphinx_fe_init() */
+static float fe_window[SPHINX_FE_WINDOW];
+static float fe_twr[SPHINX_FE_NFFT / 2], fe_twi[SPHINX_FE_NFFT / 2];
+static int fe_bitrev[SPHINX_FE_NFFT];
+static float fe_filters[SPHINX_FE_NFILT][SPHINX_FE_NBINS];
+static float fe_dct[SPHINX_FE_NCEP][SPHINX_FE_NFILT];
+
+static double sphinx_fe_mel(double hz)
+{
+	return 2595.0 * log10(1.0 + hz / 700.0);
+}
+
+static double sphinx_fe_hz(double mel)
+{
+	return 700.0 * (pow(10.0, mel / 2595.0) - 1.0);
+}
+
+/*! \brief Build window, FFT, filterbank and DCT tables */
+static void sphinx_fe_init(void)
+{
+	double melmin = sphinx_fe_mel(SPHINX_FE_LOWERF), melmax = sphinx_fe_mel(SPHINX_FE_UPPERF);
+	double binhz = (double) SPHINX_FE_RATE / SPHINX_FE_NFFT;
+	double edge[SPHINX_FE_NFILT + 2];
+	int i, j, bits;
+
+	for (i = 0; i < SPHINX_FE_WINDOW; i++)
+		fe_window[i] = 0.54 - 0.46 * cos(2 * M_PI * i / (SPHINX_FE_WINDOW - 1));
+
+	for (i = 0; i < SPHINX_FE_NFFT / 2; i++) {
+		fe_twr[i] = cos(2 * M_PI * i / SPHINX_FE_NFFT);
+		fe_twi[i] = -sin(2 * M_PI * i / SPHINX_FE_NFFT);
+	}
+	for (bits = 0; (1 << bits) < SPHINX_FE_NFFT; bits++);
+	for (i = 0; i < SPHINX_FE_NFFT; i++) {
+		fe_bitrev[i] = 0;
+		for (j = 0; j < bits; j++) {
+			if (i & (1 << j))
+				fe_bitrev[i] |= 1 << (bits - 1 - j);
+		}
+	}
+
+	/* Filter edges equally spaced in mel, rounded to FFT bins */
+	for (i = 0; i < SPHINX_FE_NFILT + 2; i++)
+		edge[i] = rint(sphinx_fe_hz(melmin + (melmax - melmin) * i / (SPHINX_FE_NFILT + 1)) / binhz) * binhz;
+	memset(fe_filters, 0, sizeof(fe_filters));
+	for (i = 0; i < SPHINX_FE_NFILT; i++) {
+		double left = edge[i], center = edge[i + 1], right = edge[i + 2];
+		double height = 2.0 / (right - left);
+
+		for (j = 0; j < SPHINX_FE_NBINS; j++) {
+			double hz = j * binhz;
+			if (hz > left && hz < center)
+				fe_filters[i][j] = height * (hz - left) / (center - left);
+			else if (hz >= center && hz < right)
+				fe_filters[i][j] = height * (right - hz) / (right - center);
+		}
+	}
+
+	/* Legacy Sphinx DCT: first log energy counts half */
+	for (i = 0; i < SPHINX_FE_NCEP; i++) {
+		for (j = 0; j < SPHINX_FE_NFILT; j++)
+			fe_dct[i][j] = cos(M_PI * i * (j + 0.5) / SPHINX_FE_NFILT) * (j ? 1.0 : 0.5) / SPHINX_FE_NFILT;
+	}
+}
+
+/*! \brief
+ * Cepstra for one window of pre-emphasized samples.  Everything past the FFT
+ * is flat loops over float arrays, which the compiler vectorizes.
+ */
+static void sphinx_fe_frame(const float *x, float *cep)
+{
+	float re[SPHINX_FE_NFFT], im[SPHINX_FE_NFFT];
+	float power[SPHINX_FE_NBINS], logspec[SPHINX_FE_NFILT];
+	int i, j, k, len, half, step;
+
+	memset(re, 0, sizeof(re));
+	memset(im, 0, sizeof(im));
+	for (i = 0; i < SPHINX_FE_WINDOW; i++)
+		re[fe_bitrev[i]] = x[i] * fe_window[i];
+
+	/* Iterative radix-2 FFT */
+	for (len = 2; len <= SPHINX_FE_NFFT; len <<= 1) {
+		half = len >> 1;
+		step = SPHINX_FE_NFFT / len;
+		for (i = 0; i < SPHINX_FE_NFFT; i += len) {
+			for (j = 0, k = 0; j < half; j++, k += step) {
+				float tr = re[i + j + half] * fe_twr[k] - im[i + j + half] * fe_twi[k];
+				float ti = re[i + j + half] * fe_twi[k] + im[i + j + half] * fe_twr[k];
+				re[i + j + half] = re[i + j] - tr;
+				im[i + j + half] = im[i + j] - ti;
+				re[i + j] += tr;
+				im[i + j] += ti;
+			}
+		}
+	}
+
+	for (k = 0; k < SPHINX_FE_NBINS; k++)
+		power[k] = re[k] * re[k] + im[k] * im[k];
+
+	for (i = 0; i < SPHINX_FE_NFILT; i++) {
+		float sum = 0;
+		for (k = 0; k < SPHINX_FE_NBINS; k++)
+			sum += fe_filters[i][k] * power[k];
+		logspec[i] = logf(sum > 1e-10f ? sum : 1e-10f);
+	}
+
+	for (i = 0; i < SPHINX_FE_NCEP; i++) {
+		float sum = 0;
+		for (j = 0; j < SPHINX_FE_NFILT; j++)
+			sum += fe_dct[i][j] * logspec[j];
+		cep[i] = sum;
+	}
+}
+
+/*! \brief Feed SLINEAR samples, returns the number of frames written to cep */
+static int sphinx_fe_process(struct sphinx_fe *fe, const int16_t *samples, int n, float *cep)
+{
+	int i, frames = 0;
+
+	for (i = 0; i < n; i++) {
+		fe->buf[fe->nbuf++] = samples[i] - SPHINX_FE_ALPHA * fe->prior;
+		fe->prior = samples[i];
+		if (fe->nbuf == SPHINX_FE_WINDOW) {
+			sphinx_fe_frame(fe->buf, cep + frames++ * SPHINX_FE_NCEP);
+			memmove(fe->buf, fe->buf + SPHINX_FE_SHIFT,
+					(SPHINX_FE_WINDOW - SPHINX_FE_SHIFT) * sizeof(float));
+			fe->nbuf -= SPHINX_FE_SHIFT;
+		}
+	}
+	fe->frames += frames;
+	return frames;
+}
+
+/*! \brief End of utterance: samples no frame has started on yet get one, zero padded */
+static int sphinx_fe_flush(struct sphinx_fe *fe, float *cep)
+{
+	if (fe->nbuf == 0 || (fe->frames && fe->nbuf <= SPHINX_FE_WINDOW - SPHINX_FE_SHIFT))
+		return 0;
+	memset(fe->buf + fe->nbuf, 0, (SPHINX_FE_WINDOW - fe->nbuf) * sizeof(float));
+	sphinx_fe_frame(fe->buf, cep);
+	fe->nbuf = 0;
+	fe->frames++;
+	return 1;
+}
+
+/*! \brief Start a new utterance */
+static void sphinx_fe_reset(struct sphinx_fe *fe)
+{
+	fe->nbuf = 0;
+	fe->prior = 0;
+	fe->frames = 0;
+}
+
+/*! \brief set socket blocking mode */
+int sphinx_set_blocking(int s, int shouldblock)
+{
+	int block = shouldblock ? 0 : O_NONBLOCK;
+	int sflags;
+
+	if ((sflags = fcntl(s, F_GETFL, 0)) == -1)
+		return SPHINX_ERROR;
+	if (fcntl(s, F_SETFL, sflags | block) == -1)
+		return SPHINX_ERROR;
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief CLI: show overload policy and counters */
+static char *handle_cli_sphinx_show_overload(struct ast_cli_entry *e, int cmd,
+											 struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show overload";
+		e->usage =
+			"Usage: sphinx en show overload\n"
+			"       Shows the send buffer overload policy and how often it kicked in.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "Policy:    %s (wait %d ms)\n", overload_names[SPHINX_OVERLOAD_POLICY],
+			SPHINX_OVERLOAD_WAIT);
+	ast_cli(a->fd, "Blocked:   %d\n", overload_stats.blocked);
+	ast_cli(a->fd, "Timeouts:  %d\n", overload_stats.timeouts);
+	ast_cli(a->fd, "Dropped:   %d\n", overload_stats.dropped);
+	ast_cli(a->fd, "Finished:  %d\n", overload_stats.finished);
+	ast_cli(a->fd, "Failed:    %d\n", overload_stats.failed);
+	return CLI_SUCCESS;
+}
+
+/*! \brief CLI: show how long final results wait before the dialplan picks them up */
+static char *handle_cli_sphinx_show_latency(struct ast_cli_entry *e, int cmd,
+											struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show latency";
+		e->usage =
+			"Usage: sphinx en show latency\n"
+			"       Shows the time from final results arriving to the dialplan reading them.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "Notify:    %s\n", SPHINX_NOTIFY ? "yes" : "no");
+	ast_cli(a->fd, "Results:   %d\n", latency_stats.results);
+	ast_cli(a->fd, "Average:   %d ms\n",
+			latency_stats.results ? latency_stats.total_ms / latency_stats.results : 0);
+	ast_cli(a->fd, "Worst:     %d ms\n", latency_stats.max_ms);
+	ast_cli(a->fd, "Early:     %d (stablefinish %d ms)\n", latency_stats.early,
+			SPHINX_STABLE_FINISH);
+	ast_cli(a->fd, "Deadlines: %d (deadline %d ms), %d without a final result\n",
+			latency_stats.deadlines, SPHINX_DEADLINE, latency_stats.abandoned);
+	return CLI_SUCCESS;
+}
+
+/*! \brief Capture writer thread */
+static void *sphinx_capture_thread(void *data)
+{
+	struct capture_rec *rec;
+
+	ast_mutex_lock(&capture_lock);
+	for (;;) {
+		while (AST_LIST_EMPTY(&capture_queue) && !capture_stop)
+			ast_cond_wait(&capture_cond, &capture_lock);
+		if ((rec = AST_LIST_REMOVE_HEAD(&capture_queue, entry)) == NULL)
+			break;
+		capture_queued -= rec->len;
+		ast_mutex_unlock(&capture_lock);
+
+		if (rec->len)
+			fwrite(rec->data, 1, rec->len, rec->fp);
+		if (rec->close)
+			fclose(rec->fp);
+		ast_free(rec);
+
+		ast_mutex_lock(&capture_lock);
+	}
+	ast_mutex_unlock(&capture_lock);
+	return NULL;
+}
+
+/*! \brief Queue a record; never blocks the channel on file I/O.  SPHINX_ERROR if it was dropped */
+static int sphinx_capture_queue(FILE *fp, const char *hdr, int hlen, const char *data, int len, int close)
+{
+	struct capture_rec *rec;
+
+	ast_mutex_lock(&capture_lock);
+	if (!close && capture_queued + hlen + len > SPHINX_CAPTURE_QUEUE) {
+		capture_dropped++;
+		ast_mutex_unlock(&capture_lock);
+		return SPHINX_ERROR;
+	}
+	capture_queued += hlen + len;
+	ast_mutex_unlock(&capture_lock);
+
+	if ((rec = ast_malloc(sizeof(*rec) + hlen + len)) == NULL) {
+		ast_mutex_lock(&capture_lock);
+		capture_queued -= hlen + len;
+		capture_dropped++;
+		ast_mutex_unlock(&capture_lock);
+		if (close)
+			fclose(fp);
+		return SPHINX_ERROR;
+	}
+	rec->fp = fp;
+	rec->close = close;
+	rec->len = hlen + len;
+	memcpy(rec->data, hdr, hlen);
+	if (len)
+		memcpy(rec->data + hlen, data, len);
+
+	ast_mutex_lock(&capture_lock);
+	AST_LIST_INSERT_TAIL(&capture_queue, rec, entry);
+	ast_cond_signal(&capture_cond);
+	ast_mutex_unlock(&capture_lock);
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Start the capture writer */
+static int sphinx_capture_start(void)
+{
+	if (ast_strlen_zero(SPHINX_CAPTURE_DIR))
+		snprintf(SPHINX_CAPTURE_DIR, sizeof(SPHINX_CAPTURE_DIR), "%s/sphinx", ast_config_AST_LOG_DIR);
+	if (ast_mkdir(SPHINX_CAPTURE_DIR, 0755))
+		return SPHINX_ERROR;
+
+	ast_cond_init(&capture_cond, NULL);
+	capture_stop = 0;
+	if (ast_pthread_create_background(&capture_thread, NULL, sphinx_capture_thread, NULL)) {
+		capture_thread = AST_PTHREADT_NULL;
+		ast_cond_destroy(&capture_cond);
+		return SPHINX_ERROR;
+	}
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Stop the capture writer once everything queued is on disk */
+static void sphinx_capture_stop(void)
+{
+	if (capture_thread == AST_PTHREADT_NULL)
+		return;
+
+	ast_mutex_lock(&capture_lock);
+	capture_stop = 1;
+	ast_cond_signal(&capture_cond);
+	ast_mutex_unlock(&capture_lock);
+	pthread_join(capture_thread, NULL);
+	capture_thread = AST_PTHREADT_NULL;
+	ast_cond_destroy(&capture_cond);
+}
+
+/*! \brief
+ * Shadow traffic.  A sampled shadowrate percent of sessions have their grammar,
+ * audio and utterance ends mirrored to the canary recognizer at shadowserver,
+ * and each final result is compared with the one the canary comes up with.
+ *
+ * Channel threads only ever copy a record into a bounded lock-free ring of
+ * fixed slots and move on; when the ring is full the session stops being
+ * mirrored.  One sender thread drains it, keeps a legacy-framed connection to
+ * the canary per mirrored session and logs the comparisons, so a slow or dead
+ * canary costs production nothing but the copy.
+ */
+#define SPHINX_SHADOW_DATA     640	/* Largest mirrored payload: a 20 ms frame, a grammar or a result */
+#define SPHINX_SHADOW_MAXCONNS 256	/* Canary connections open at once */
+#define SPHINX_SHADOW_IDLE     60000	/* Forget a mirror nothing was heard of for this long, ms */
+
+/* Record types besides the e_reqtype mirrored */
+#define SHADOW_REC_RESULT  -1		/* Production's final result */
+#define SHADOW_REC_CANCEL  -2		/* Utterance dropped, ignore the canary's answer */
+#define SHADOW_REC_CLOSE   -3		/* Session is gone */
+
+struct shadow_rec {
+	unsigned int id;			/* Mirrored session */
+	int type;					/* enum e_reqtype or SHADOW_REC_* */
+	int score;					/* SHADOW_REC_RESULT */
+	int ms;						/* SHADOW_REC_RESULT: finish to final result */
+	int len;
+	char data[SPHINX_SHADOW_DATA];
+};
+
+/*! \brief Ring slot; seq says whose turn it is, see sphinx_shadow_push() */
+struct shadow_slot {
+	unsigned int seq;
+	struct shadow_rec rec;
+};
+
+/*! \brief A mirrored session, as the sender thread sees it */
+struct shadow_conn {
+	unsigned int id;
+	int s;						/* Socket to the canary, -1 once given up on */
+	char grammar[64];
+	int sent;					/* Requests sent, each gets one response */
+	int answered;				/* Responses read */
+	int finalreq;				/* Request whose response is the final result, 0 for none */
+	int discard;				/* That result is not to be compared */
+	struct timeval finish_tv;	/* When it was sent */
+	int canary_score;
+	int canary_ms;
+	int have_canary;
+	char canary[256];
+	int prod_score;
+	int prod_ms;
+	int have_prod;
+	char prod[256];
+	char rbuf[SPHINX_BUFSIZE];
+	int rused;
+	struct timeval active_tv;	/* Last record for it */
+	AST_LIST_ENTRY(shadow_conn) entry;
+};
+
+static struct shadow_slot *shadow_ring;
+static unsigned int shadow_mask;
+static unsigned int shadow_head;	/* Next slot to claim, producers */
+static unsigned int shadow_tail;	/* Next slot to read, sender thread only */
+static int shadow_ids;
+static struct sockaddr_in shadow_sin;
+static pthread_t shadow_thread = AST_PTHREADT_NULL;
+static int shadow_stop;
+static AST_LIST_HEAD_NOLOCK_STATIC(shadow_conns, shadow_conn);
+
+/*! \brief Shadow counters */
+static struct {
+	int sessions;				/* Sessions picked for mirroring */
+	int dropped;				/* Records the ring had no room for */
+	int lost;					/* Sessions given up on: ring full, canary refused or failed */
+	int open;					/* Canary connections open */
+	int compared;
+	int matched;
+	int prod_ms;				/* Totals over the comparisons */
+	int canary_ms;
+	int slower;					/* Canary took longer */
+} shadow_stats;
+
+/*! \brief
+ * Copy a record into the ring, never waiting: each slot's seq equals its
+ * position when free and position + 1 once filled, so producers claim a slot
+ * with one compare-and-swap on shadow_head and publish it by storing seq.
+ */
+static int sphinx_shadow_push(unsigned int id, int type, int score, int ms, const void *data, int len)
+{
+	struct shadow_slot *slot;
+	unsigned int pos = __atomic_load_n(&shadow_head, __ATOMIC_RELAXED);
+	int diff;
+
+	if (len > SPHINX_SHADOW_DATA)
+		return SPHINX_ERROR;
+	for (;;) {
+		slot = &shadow_ring[pos & shadow_mask];
+		diff = (int) (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&shadow_head, &pos, pos + 1, 1,
+											__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			ast_atomic_fetchadd_int(&shadow_stats.dropped, 1);
+			return SPHINX_ERROR;
+		} else {
+			pos = __atomic_load_n(&shadow_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->rec.id = id;
+	slot->rec.type = type;
+	slot->rec.score = score;
+	slot->rec.ms = ms;
+	slot->rec.len = len;
+	if (len)
+		memcpy(slot->rec.data, data, len);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Mirror one record of a session; the first the ring refuses ends its mirroring */
+static void sphinx_shadow(struct sphinx_state *ss, int type, int score, int ms, const void *data, int len)
+{
+	if (sphinx_shadow_push(ss->shadow, type, score, ms, data, len) == SPHINX_SUCCESS)
+		return;
+	ast_atomic_fetchadd_int(&shadow_stats.lost, 1);
+	sphinx_shadow_push(ss->shadow, SHADOW_REC_CLOSE, 0, 0, NULL, 0);
+	ss->shadow = 0;
+	ss->shadowutt = 0;
+}
+
+/*! \brief Pick a new session for mirroring, or not */
+static void sphinx_shadow_pick(struct sphinx_state *ss)
+{
+	ss->shadow = 0;
+	ss->shadowutt = 0;
+	if (shadow_thread == AST_PTHREADT_NULL || ast_random() % 100 >= SPHINX_SHADOW_RATE)
+		return;
+	while (!(ss->shadow = ast_atomic_fetchadd_int(&shadow_ids, 1) + 1));
+	ast_atomic_fetchadd_int(&shadow_stats.sessions, 1);
+}
+
+/*! \brief Mirror a session's audio, in slot-sized requests; len 0 ends the utterance */
+static void sphinx_shadow_audio(struct sphinx_state *ss, const char *data, int len)
+{
+	int n;
+
+	if (len) {
+		ss->shadowutt = 1;
+		for (; len > 0 && ss->shadow; data += n, len -= n) {
+			n = MIN(len, SPHINX_SHADOW_DATA);
+			sphinx_shadow(ss, REQTYPE_DATA, 0, 0, data, n);
+		}
+	} else if (ss->shadowutt) {
+		ss->shadowutt = 0;
+		ss->shadow_tv = ast_tvnow();
+		sphinx_shadow(ss, REQTYPE_DATA, 0, 0, NULL, 0);
+	}
+}
+
+/*! \brief Mirror a dropped utterance */
+static void sphinx_shadow_cancel(struct sphinx_state *ss)
+{
+	if (ss->shadowutt) {
+		ss->shadowutt = 0;
+		sphinx_shadow(ss, SHADOW_REC_CANCEL, 0, 0, NULL, 0);
+	}
+	ss->shadow_tv = ast_tv(0, 0);
+}
+
+/*! \brief Hand production's final result over for the comparison */
+static void sphinx_shadow_result(struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	const char *text = "";
+	int score = 0;
+
+	if (ast_tvzero(ss->shadow_tv))
+		return;
+	if (speech->results) {
+		text = S_OR(speech->results->text, "");
+		score = speech->results->score;
+	}
+	sphinx_shadow(ss, SHADOW_REC_RESULT, score, ast_tvdiff_ms(ast_tvnow(), ss->shadow_tv),
+				  text, MIN(strlen(text), sizeof(((struct shadow_conn *) 0)->prod) - 1));
+	ss->shadow_tv = ast_tv(0, 0);
+}
+
+/*! \brief Mirror the end of a session */
+static void sphinx_shadow_close(struct sphinx_state *ss)
+{
+	if (ss->shadow)
+		sphinx_shadow_push(ss->shadow, SHADOW_REC_CLOSE, 0, 0, NULL, 0);
+	ss->shadow = 0;
+	ss->shadowutt = 0;
+}
+
+/*! \brief Log the comparison once both results of an utterance are in */
+static void sphinx_shadow_compare(struct shadow_conn *sc)
+{
+	int match;
+
+	if (!sc->have_prod || !sc->have_canary)
+		return;
+	match = !strcmp(sc->prod, sc->canary);
+	shadow_stats.compared++;
+	shadow_stats.matched += match;
+	shadow_stats.prod_ms += sc->prod_ms;
+	shadow_stats.canary_ms += sc->canary_ms;
+	shadow_stats.slower += sc->canary_ms > sc->prod_ms;
+	if (match)
+		ast_log(LOG_DEBUG, "Shadow %u grammar %s: '%s' (%d ms, canary %d ms)\n", sc->id,
+				S_OR(sc->grammar, "(none)"), sc->prod, sc->prod_ms, sc->canary_ms);
+	else
+		ast_log(LOG_NOTICE,
+				"Shadow %u grammar %s differs: production '%s' (%d, %d ms) canary '%s' (%d, %d ms)\n",
+				sc->id, S_OR(sc->grammar, "(none)"), sc->prod, sc->prod_score, sc->prod_ms,
+				sc->canary, sc->canary_score, sc->canary_ms);
+	sc->have_prod = sc->have_canary = 0;
+}
+
+/*! \brief Give up on the canary for a session; its records are ignored until it closes */
+static void sphinx_shadow_fail(struct shadow_conn *sc, const char *why)
+{
+	if (sc->s < 0)
+		return;
+	ast_log(LOG_DEBUG, "Shadow %u: %s, no longer mirrored\n", sc->id, why);
+	if (sc->s > 0) {
+		close(sc->s);
+		shadow_stats.open--;
+	}
+	sc->s = -1;
+	shadow_stats.lost++;
+}
+
+/*! \brief Send one request to the canary in legacy framing; waits a little at most */
+static void sphinx_shadow_send(struct shadow_conn *sc, enum e_reqtype rtype, const char *data, int dlen)
+{
+	char buf[sizeof(int) + sizeof(enum e_reqtype) + SPHINX_SHADOW_DATA];
+	int len = sizeof(dlen) + sizeof(rtype) + dlen;
+
+	if (sc->s < 0)
+		return;
+	if (sc->s == 0) {
+		if (shadow_stats.open >= SPHINX_SHADOW_MAXCONNS) {
+			sphinx_shadow_fail(sc, "too many canary connections");
+			return;
+		}
+		/* Blocking with a send timeout: a stalled canary holds up only this thread */
+		if ((sc->s = socket(AF_INET, SOCK_STREAM, 0)) <= 0) {
+			sc->s = 0;
+			sphinx_shadow_fail(sc, "no socket");
+			return;
+		}
+		shadow_stats.open++;
+		setsockopt(sc->s, SOL_SOCKET, SO_SNDTIMEO, &(struct timeval){ 0, 100000 }, sizeof(struct timeval));
+		if (connect(sc->s, (struct sockaddr *) &shadow_sin, sizeof(shadow_sin))) {
+			sphinx_shadow_fail(sc, "canary refused");
+			return;
+		}
+	}
+
+	memcpy(buf, &dlen, sizeof(dlen));
+	memcpy(buf + sizeof(dlen), &rtype, sizeof(rtype));
+	if (dlen)
+		memcpy(buf + sizeof(dlen) + sizeof(rtype), data, dlen);
+	if (send(sc->s, buf, len, MSG_NOSIGNAL) != len) {
+		sphinx_shadow_fail(sc, "canary write failed");
+		return;
+	}
+	sc->sent++;
+}
+
+/*! \brief Read what the canary answered; each response is int32 length, score and text */
+static void sphinx_shadow_read(struct shadow_conn *sc)
+{
+	int n, len;
+
+	n = recv(sc->s, sc->rbuf + sc->rused, sizeof(sc->rbuf) - sc->rused, MSG_DONTWAIT);
+	if (n <= 0) {
+		if (n == 0 || (errno != EAGAIN && errno != EINTR))
+			sphinx_shadow_fail(sc, "canary closed");
+		return;
+	}
+	sc->rused += n;
+
+	while (sc->rused >= (int) sizeof(int32_t)) {
+		memcpy(&len, sc->rbuf, sizeof(len));
+		if (len < (int) sizeof(int32_t) || len > (int) sizeof(sc->rbuf) - (int) sizeof(int32_t)) {
+			sphinx_shadow_fail(sc, "bad canary response");
+			return;
+		}
+		if (sc->rused < (int) sizeof(int32_t) + len)
+			break;
+
+		if (++sc->answered == sc->finalreq) {
+			if (!sc->discard) {
+				int tlen = MIN(len - (int) sizeof(int32_t), (int) sizeof(sc->canary) - 1);
+
+				memcpy(&sc->canary_score, sc->rbuf + sizeof(int32_t), sizeof(int32_t));
+				memcpy(sc->canary, sc->rbuf + 2 * sizeof(int32_t), tlen);
+				sc->canary[tlen] = '\0';
+				sc->canary_ms = ast_tvdiff_ms(ast_tvnow(), sc->finish_tv);
+				sc->have_canary = 1;
+				sphinx_shadow_compare(sc);
+			}
+			sc->finalreq = 0;
+		}
+		sc->rused -= sizeof(int32_t) + len;
+		memmove(sc->rbuf, sc->rbuf + sizeof(int32_t) + len, sc->rused);
+	}
+}
+
+/*! \brief Act on one record from the ring */
+static void sphinx_shadow_handle(struct shadow_rec *rec)
+{
+	struct shadow_conn *sc;
+
+	AST_LIST_TRAVERSE(&shadow_conns, sc, entry) {
+		if (sc->id == rec->id)
+			break;
+	}
+	if (sc == NULL) {
+		if (rec->type == SHADOW_REC_CLOSE || rec->type == SHADOW_REC_RESULT)
+			return;
+		if ((sc = ast_calloc(1, sizeof(*sc))) == NULL)
+			return;
+		sc->id = rec->id;
+		AST_LIST_INSERT_HEAD(&shadow_conns, sc, entry);
+	}
+	sc->active_tv = ast_tvnow();
+
+	switch (rec->type) {
+	case SHADOW_REC_CLOSE:
+		if (sc->s > 0) {
+			close(sc->s);
+			shadow_stats.open--;
+		}
+		AST_LIST_REMOVE(&shadow_conns, sc, entry);
+		ast_free(sc);
+		break;
+	case SHADOW_REC_RESULT:
+		sc->prod_score = rec->score;
+		sc->prod_ms = rec->ms;
+		memcpy(sc->prod, rec->data, rec->len);
+		sc->prod[rec->len] = '\0';
+		sc->have_prod = 1;
+		sphinx_shadow_compare(sc);
+		break;
+	case SHADOW_REC_CANCEL:
+		/* The canary still answers the wrap-up, nobody compares it */
+		sphinx_shadow_send(sc, REQTYPE_DATA, NULL, 0);
+		sc->finalreq = sc->sent;
+		sc->discard = 1;
+		sc->have_prod = sc->have_canary = 0;
+		break;
+	case REQTYPE_GRAMMAR:
+		ast_copy_string(sc->grammar, rec->data, MIN(rec->len + 1, sizeof(sc->grammar)));
+		sphinx_shadow_send(sc, REQTYPE_GRAMMAR, rec->data, rec->len);
+		break;
+	default:
+		sphinx_shadow_send(sc, rec->type, rec->data, rec->len);
+		if (rec->type == REQTYPE_DATA && rec->len == 0) {
+			sc->finalreq = sc->sent;
+			sc->discard = 0;
+			sc->finish_tv = ast_tvnow();
+			sc->have_canary = 0;
+		}
+		break;
+	}
+}
+
+/*! \brief Shadow sender thread: drains the ring and reads what the canary says */
+static void *sphinx_shadow_thread(void *data)
+{
+	struct pollfd pfds[SPHINX_SHADOW_MAXCONNS];
+	struct shadow_conn *conns[SPHINX_SHADOW_MAXCONNS], *sc;
+	struct shadow_slot *slot;
+	struct timeval now;
+	int n, i;
+
+	while (!shadow_stop) {
+		for (;;) {
+			slot = &shadow_ring[shadow_tail & shadow_mask];
+			if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != shadow_tail + 1)
+				break;
+			sphinx_shadow_handle(&slot->rec);
+			__atomic_store_n(&slot->seq, shadow_tail + shadow_mask + 1, __ATOMIC_RELEASE);
+			shadow_tail++;
+		}
+
+		/* Nothing wakes us for new records; a short poll keeps up with the ring */
+		n = 0;
+		now = ast_tvnow();
+		AST_LIST_TRAVERSE_SAFE_BEGIN(&shadow_conns, sc, entry) {
+			if (ast_tvdiff_ms(now, sc->active_tv) > SPHINX_SHADOW_IDLE) {
+				sphinx_shadow_fail(sc, "session idle");
+				AST_LIST_REMOVE_CURRENT(entry);
+				ast_free(sc);
+				continue;
+			}
+			if (sc->s > 0 && n < SPHINX_SHADOW_MAXCONNS) {
+				pfds[n].fd = sc->s;
+				pfds[n].events = POLLIN;
+				conns[n++] = sc;
+			}
+		}
+		AST_LIST_TRAVERSE_SAFE_END;
+
+		if (poll(pfds, n, 10) <= 0)
+			continue;
+		for (i = 0; i < n; i++) {
+			if (pfds[i].revents)
+				sphinx_shadow_read(conns[i]);
+		}
+	}
+
+	while ((sc = AST_LIST_REMOVE_HEAD(&shadow_conns, entry))) {
+		if (sc->s > 0)
+			close(sc->s);
+		ast_free(sc);
+	}
+	shadow_stats.open = 0;
+	return NULL;
+}
+
+/*! \brief Start mirroring to the canary */
+static int sphinx_shadow_start(void)
+{
+	char host[sizeof(SPHINX_SHADOW_SERVER)], *port;
+	struct hostent *hp;
+	struct ast_hostent ahp;
+	unsigned int i, size = 1;
+
+	ast_copy_string(host, SPHINX_SHADOW_SERVER, sizeof(host));
+	shadow_sin.sin_family = AF_INET;
+	shadow_sin.sin_port = htons(SPHINX_SERVER_PORT);
+	if ((port = strchr(host, ':'))) {
+		*port++ = '\0';
+		shadow_sin.sin_port = htons(atoi(port));
+	}
+	if ((hp = ast_gethostbyname(host, &ahp)) == NULL)
+		return SPHINX_ERROR;
+	memcpy(&shadow_sin.sin_addr, hp->h_addr, sizeof(shadow_sin.sin_addr));
+
+	while (size < (unsigned int) SPHINX_SHADOW_QUEUE)
+		size <<= 1;
+	if ((shadow_ring = ast_calloc(size, sizeof(*shadow_ring))) == NULL)
+		return SPHINX_ERROR;
+	for (i = 0; i < size; i++)
+		shadow_ring[i].seq = i;
+	shadow_mask = size - 1;
+	shadow_head = shadow_tail = 0;
+
+	shadow_stop = 0;
+	if (ast_pthread_create_background(&shadow_thread, NULL, sphinx_shadow_thread, NULL)) {
+		shadow_thread = AST_PTHREADT_NULL;
+		ast_free(shadow_ring);
+		shadow_ring = NULL;
+		return SPHINX_ERROR;
+	}
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Stop mirroring; whatever is still in the ring is dropped */
+static void sphinx_shadow_stop(void)
+{
+	if (shadow_thread == AST_PTHREADT_NULL)
+		return;
+	shadow_stop = 1;
+	pthread_join(shadow_thread, NULL);
+	shadow_thread = AST_PTHREADT_NULL;
+	ast_free(shadow_ring);
+	shadow_ring = NULL;
+}
+
+/*! \brief Replay job */
+struct replay_job {
+	int fast;					/* Ignore captured timing */
+	char file[PATH_MAX];
+};
+
+/*! \brief
+ * read one capture record, payload into a buffer of SPHINX_BUFSIZE + 1.
+ * wide is 0 for SPHINX_CAPTURE_MAGIC1 files, whose delta is 32 bits.
+ */
+static int sphinx_replay_read(FILE *fp, int wide, int *dir, unsigned long long *usec,
+							  unsigned int *type, char *data, int *len)
+{
+	char hdr[SPHINX_CAPTURE_RECHDR];
+	int hlen = wide ? SPHINX_CAPTURE_RECHDR : SPHINX_CAPTURE_RECHDR1, off = wide ? 4 : 0;
+
+	if (fread(hdr, 1, hlen, fp) != hlen)
+		return SPHINX_ERROR;
+	*dir = hdr[0];
+	*usec = sphinx_get32(hdr + 1);
+	if (wide)
+		*usec |= (unsigned long long) sphinx_get32(hdr + 5) << 32;
+	*type = sphinx_get32(hdr + 5 + off);
+	*len = sphinx_get32(hdr + 13 + off);
+	if (*len < 0 || *len > SPHINX_BUFSIZE || fread(data, 1, *len, fp) != *len)
+		return SPHINX_ERROR;
+	data[*len] = '\0';
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief
+ * Feeds a capture file back through this engine, against whatever server is
+ * configured, and compares the final result and its latency with the capture.
+ */
+static void *sphinx_replay_thread(void *data)
+{
+	struct replay_job *job = data;
+	struct ast_speech *speech = NULL;
+	char magic[sizeof(SPHINX_CAPTURE_MAGIC) - 1];
+	char payload[SPHINX_BUFSIZE + 1], grammar[256] = "", expected[SPHINX_BUFSIZE + 1] = "";
+	struct timeval start = ast_tvnow(), finished = { 0, }, due;
+	long long offset = 0, finish_offset = -1, expected_ms = -1;
+	unsigned long long usec;
+	unsigned int type, want = 0;
+	int dir, len, wide, frames = 0;
+	FILE *fp;
+
+	if ((fp = fopen(job->file, "r")) == NULL) {
+		ast_log(LOG_ERROR, "Replay: cannot open %s: %s\n", job->file, strerror(errno));
+		goto done;
+	}
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+		(!(wide = !memcmp(magic, SPHINX_CAPTURE_MAGIC, sizeof(magic))) &&
+		 memcmp(magic, SPHINX_CAPTURE_MAGIC1, sizeof(magic)))) {
+		ast_log(LOG_ERROR, "Replay: %s is not a Sphinx capture\n", job->file);
+		goto done;
+	}
+	create_priority = SPHINX_PRIO_BATCH;
+	speech = ast_speech_new(SPHINX_ENGINE_INFO.name, AST_FORMAT_SLINEAR);
+	create_priority = -1;
+	if (speech == NULL) {
+		ast_log(LOG_ERROR, "Replay: cannot create a %s session\n", SPHINX_ENGINE_INFO.name);
+		goto done;
+	}
+
+	while (sphinx_replay_read(fp, wide, &dir, &usec, &type, payload, &len) == SPHINX_SUCCESS) {
+		offset += usec;
+
+		/*
+		 * DATA payloads are fed back as SLINEAR, so a capture whose session
+		 * sent cepstra instead can't be replayed: the handshake tells.
+		 */
+		if (dir == SPHINX_CAPTURE_REQUEST && type == REQTYPE_HELLO) {
+			want = len >= 4 * sizeof(uint32_t) ? sphinx_get32(payload + 12) : 0;
+			continue;
+		}
+		if (dir == SPHINX_CAPTURE_RESPONSE && want && len >= 3 * sizeof(uint32_t) &&
+			sphinx_get32(payload) == SPHINX_PROTO_MAGIC &&
+			(sphinx_get32(payload + 8) & want & SPHINX_CAP_FEATURES)) {
+			ast_log(LOG_ERROR, "Replay: %s carries client-side features, not audio; cannot replay it\n",
+					job->file);
+			goto done;
+		}
+
+		if (dir == SPHINX_CAPTURE_RESPONSE) {
+			want = 0;
+			if (type == RESPTYPE_RESULT && len >= sizeof(int32_t) && finish_offset >= 0) {
+				ast_copy_string(expected, payload + sizeof(int32_t), sizeof(expected));
+				expected_ms = (offset - finish_offset) / 1000;
+			}
+			continue;
+		}
+
+		if (!job->fast) {
+			due = ast_tvadd(start, ast_tv(offset / 1000000, offset % 1000000));
+			if (ast_tvcmp(due, ast_tvnow()) > 0)
+				usleep(ast_tvdiff_us(due, ast_tvnow()));
+		}
+
+		ast_mutex_lock(&speech->lock);
+		switch (type) {
+		case REQTYPE_GRAMMAR:
+			ast_copy_string(grammar, payload, sizeof(grammar));
+			ast_mutex_unlock(&speech->lock);
+			ast_speech_grammar_activate(speech, grammar);
+			ast_speech_start(speech);
+			ast_mutex_lock(&speech->lock);
+			break;
+		case REQTYPE_TUNE: {
+			char *value = strchr(payload, '=');
+			if (value != NULL) {
+				*value++ = '\0';
+				ast_speech_change(speech, payload, value);
+			}
+			break;
+		}
+		case REQTYPE_DATA:
+		case REQTYPE_FINISH:
+			if (speech->state != AST_SPEECH_STATE_READY)
+				break;
+			if (len && type == REQTYPE_DATA) {
+				ast_speech_write(speech, payload, len);
+				frames++;
+			}
+			if (speech->state != AST_SPEECH_STATE_READY || !len || type == REQTYPE_FINISH) {
+				if (speech->state == AST_SPEECH_STATE_READY)
+					sphinx_deactivate(speech, grammar);
+				finished = ast_tvnow();
+				finish_offset = offset;
+			}
+			break;
+		}
+		ast_mutex_unlock(&speech->lock);
+	}
+
+	if (speech->state == AST_SPEECH_STATE_WAIT)
+		sphinx_wait_result(speech, 5000);
+
+	ast_mutex_lock(&speech->lock);
+	ast_log(LOG_NOTICE, "Replay of %s: %d frames, result '%s' (captured '%s') %s, "
+			"%d ms after finish (captured %d ms)\n", job->file, frames,
+			speech->results ? S_OR(speech->results->text, "") : "", expected,
+			!strcmp(speech->results ? S_OR(speech->results->text, "") : "", expected) ? "MATCH" : "MISMATCH",
+			ast_tvzero(finished) ? -1 : (int) ast_tvdiff_ms(ast_tvnow(), finished), (int) expected_ms);
+	ast_mutex_unlock(&speech->lock);
+
+done:
+	if (speech != NULL)
+		ast_speech_destroy(speech);
+	if (fp != NULL)
+		fclose(fp);
+	ast_free(job);
+	return NULL;
+}
+
+/*! \brief CLI: replay a wire capture */
+static char *handle_cli_sphinx_replay(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct replay_job *job;
+	pthread_t thread;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en replay";
+		e->usage =
+			"Usage: sphinx en replay <file> [fast]\n"
+			"       Feeds a wire capture back through this engine, at the captured pace or\n"
+			"       as fast as possible, and logs how the result and latency compare.\n"
+			"       Captures of sessions that sent client-side features are refused.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc < 4 || a->argc > 5 || (a->argc == 5 && strcasecmp(a->argv[4], "fast")))
+		return CLI_SHOWUSAGE;
+
+	if ((job = ast_calloc(1, sizeof(*job))) == NULL)
+		return CLI_FAILURE;
+	job->fast = (a->argc == 5);
+	if (a->argv[3][0] == '/')
+		ast_copy_string(job->file, a->argv[3], sizeof(job->file));
+	else
+		snprintf(job->file, sizeof(job->file), "%s/%s", SPHINX_CAPTURE_DIR, a->argv[3]);
+
+	if (ast_pthread_create_detached_background(&thread, NULL, sphinx_replay_thread, job)) {
+		ast_free(job);
+		return CLI_FAILURE;
+	}
+	ast_cli(a->fd, "Replaying %s, results will be logged.\n", job->file);
+	return CLI_SUCCESS;
+}
+
+/*! \brief Bulk transcription job, shared by its worker threads */
+struct bulk_job {
+	ast_mutex_t lock;
+	char grammar[256];
+	int nfiles;
+	int next;					/* Next file to hand out */
+	int running;				/* Workers still going */
+	int done;					/* Files transcribed */
+	int failed;					/* Files that could not be */
+	long long audio_ms;			/* Audio transcribed */
+	long long busy_ms;			/* Sum of per-file wall times */
+	struct timeval start;
+	char **files;
+};
+
+/*! \brief
+ * Opens an 8 kHz 16-bit mono WAV, or raw signed linear (.sln/.raw), and leaves
+ * fp at the first sample.  Returns the number of audio bytes, -1 if unusable.
+ */
+static long sphinx_bulk_open(FILE *fp, const char *path)
+{
+	char chunk[8], fmt[16];
+	long size;
+
+	if (fread(chunk, 1, 4, fp) != 4)
+		return -1;
+	if (memcmp(chunk, "RIFF", 4)) {
+		const char *ext = strrchr(path, '.');
+		if (ext == NULL || (strcasecmp(ext, ".sln") && strcasecmp(ext, ".raw")))
+			return -1;
+		fseek(fp, 0, SEEK_END);
+		size = ftell(fp);
+		fseek(fp, 0, SEEK_SET);
+		return size;
+	}
+
+	if (fread(chunk, 1, 8, fp) != 8 || memcmp(chunk + 4, "WAVE", 4))
+		return -1;
+	while (fread(chunk, 1, 8, fp) == 8) {
+		size = sphinx_get32(chunk + 4);
+		if (!memcmp(chunk, "data", 4))
+			return size;
+		if (!memcmp(chunk, "fmt ", 4)) {
+			if (size < sizeof(fmt) || fread(fmt, 1, sizeof(fmt), fp) != sizeof(fmt))
+				return -1;
+			/* PCM, mono, 8000 Hz, 16 bits */
+			if ((sphinx_get32(fmt) & 0xffff) != 1 || (sphinx_get32(fmt) >> 16) != 1 ||
+				sphinx_get32(fmt + 4) != 8000 || (sphinx_get32(fmt + 12) >> 16) != 16)
+				return -1;
+			size -= sizeof(fmt);
+		}
+		if (fseek(fp, size + (size & 1), SEEK_CUR))
+			return -1;
+	}
+	return -1;
+}
+
+/*! \brief
+ * Streams one file through a session as fast as the server takes it, in
+ * requests as large as sbuf allows and with no endpointing, then collects the
+ * final result.
+ */
+static int sphinx_bulk_file(struct bulk_job *job, const char *path, long *audio_ms)
+{
+	struct ast_speech *speech;
+	struct sphinx_state *ss;
+	char buf[(SPHINX_BUFSIZE - SPHINX_REQHDR_V1) & ~1];
+	long left, n;
+	FILE *fp;
+	int res = SPHINX_ERROR;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		ast_log(LOG_WARNING, "Transcribe: cannot open %s: %s\n", path, strerror(errno));
+		return SPHINX_ERROR;
+	}
+	if ((left = sphinx_bulk_open(fp, path)) < 0) {
+		ast_log(LOG_WARNING, "Transcribe: %s is not 8 kHz 16-bit mono WAV or raw slin\n", path);
+		fclose(fp);
+		return SPHINX_ERROR;
+	}
+	*audio_ms = left / 16;
+
+	/* Transcription soaks up what callers leave over */
+	create_priority = SPHINX_PRIO_BATCH;
+	speech = ast_speech_new(SPHINX_ENGINE_INFO.name, AST_FORMAT_SLINEAR);
+	create_priority = -1;
+	if (speech == NULL) {
+		fclose(fp);
+		return SPHINX_ERROR;
+	}
+	if (ast_speech_grammar_activate(speech, job->grammar) || ast_speech_start(speech))
+		goto done;
+
+	ast_mutex_lock(&speech->lock);
+	ss = (struct sphinx_state *) speech->data;
+	ss->bulk = 1;
+	while (left > 0 && (n = fread(buf, 1, MIN(left, sizeof(buf)), fp)) > 0) {
+		left -= n;
+		if ((n & ~1) && sphinx_send_audio(speech, buf, n & ~1, 0) != SPHINX_SUCCESS)
+			break;
+	}
+	if (left <= 0 && sphinx_send_audio(speech, NULL, 0, 0) == SPHINX_SUCCESS)
+		res = SPHINX_SUCCESS;
+	ast_mutex_unlock(&speech->lock);
+
+	if (res == SPHINX_SUCCESS && speech->state == AST_SPEECH_STATE_WAIT &&
+		sphinx_wait_result(speech, 5000) != 1)
+		res = SPHINX_ERROR;
+
+	ast_mutex_lock(&speech->lock);
+	if (res == SPHINX_SUCCESS && speech->state == AST_SPEECH_STATE_DONE)
+		ast_log(LOG_NOTICE, "Transcribe: %s: '%s'\n", path,
+				speech->results ? S_OR(speech->results->text, "") : "");
+	else
+		res = SPHINX_ERROR;
+	ast_mutex_unlock(&speech->lock);
+
+done:
+	ast_speech_destroy(speech);
+	fclose(fp);
+	return res;
+}
+
+/*! \brief Bulk transcription worker; the last one out reports and cleans up */
+static void *sphinx_bulk_thread(void *data)
+{
+	struct bulk_job *job = data;
+	struct timeval start;
+	long audio_ms;
+	int i, res, last;
+
+	for (;;) {
+		ast_mutex_lock(&job->lock);
+		i = job->next < job->nfiles ? job->next++ : -1;
+		ast_mutex_unlock(&job->lock);
+		if (i < 0)
+			break;
+
+		start = ast_tvnow();
+		audio_ms = 0;
+		res = sphinx_bulk_file(job, job->files[i], &audio_ms);
+
+		ast_mutex_lock(&job->lock);
+		if (res == SPHINX_SUCCESS) {
+			job->done++;
+			job->audio_ms += audio_ms;
+			job->busy_ms += ast_tvdiff_ms(ast_tvnow(), start);
+		} else {
+			job->failed++;
+		}
+		ast_mutex_unlock(&job->lock);
+	}
+
+	ast_mutex_lock(&job->lock);
+	last = !--job->running;
+	ast_mutex_unlock(&job->lock);
+	if (!last)
+		return NULL;
+
+	{
+		long long wall_ms = ast_tvdiff_ms(ast_tvnow(), job->start);
+		ast_log(LOG_NOTICE, "Transcribe: %d files done, %d failed, %lld s of audio in %lld ms: "
+				"RTF %.3f per stream, %.3f overall\n", job->done, job->failed,
+				job->audio_ms / 1000, wall_ms,
+				job->audio_ms ? (double) job->busy_ms / job->audio_ms : 0.0,
+				job->audio_ms ? (double) wall_ms / job->audio_ms : 0.0);
+	}
+	for (i = 0; i < job->nfiles; i++)
+		ast_free(job->files[i]);
+	ast_free(job->files);
+	ast_mutex_destroy(&job->lock);
+	ast_free(job);
+	return NULL;
+}
+
+/*! \brief CLI: offline transcription of recorded audio */
+static char *handle_cli_sphinx_transcribe(struct ast_cli_entry *e, int cmd,
+										  struct ast_cli_args *a)
+{
+	struct bulk_job *job;
+	pthread_t thread;
+	int i, workers;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en transcribe";
+		e->usage =
+			"Usage: sphinx en transcribe <grammar> <file> [<file> ...]\n"
+			"       Streams recorded 8 kHz WAV or slin files through the recognizer as\n"
+			"       fast as it accepts them, up to bulkworkers files at a time, and logs\n"
+			"       each transcript and the real-time factor.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc < 5)
+		return CLI_SHOWUSAGE;
+
+	if ((job = ast_calloc(1, sizeof(*job))) == NULL ||
+		(job->files = ast_calloc(a->argc - 4, sizeof(char *))) == NULL) {
+		ast_free(job);
+		return CLI_FAILURE;
+	}
+	ast_mutex_init(&job->lock);
+	ast_copy_string(job->grammar, a->argv[3], sizeof(job->grammar));
+	for (i = 4; i < a->argc; i++) {
+		if ((job->files[job->nfiles] = ast_strdup(a->argv[i])) != NULL)
+			job->nfiles++;
+	}
+	job->start = ast_tvnow();
+
+	workers = MIN(SPHINX_BULK_WORKERS, job->nfiles);
+	ast_mutex_lock(&job->lock);
+	for (i = 0; i < workers; i++) {
+		if (ast_pthread_create_detached_background(&thread, NULL, sphinx_bulk_thread, job))
+			break;
+		job->running++;
+	}
+	ast_mutex_unlock(&job->lock);
+
+	if (!i) {
+		for (i = 0; i < job->nfiles; i++)
+			ast_free(job->files[i]);
+		ast_free(job->files);
+		ast_mutex_destroy(&job->lock);
+		ast_free(job);
+		return CLI_FAILURE;
+	}
+	ast_cli(a->fd, "Transcribing %d files with %d workers, results will be logged.\n",
+			a->argc - 4, i);
+	return CLI_SUCCESS;
+}
+
+/*! \brief
+ * Round trips for one socket profile: grammar activation (header plus a short
+ * payload) and utterance finish (a lone header, then the final result) after a
+ * second of silence.
+ */
+static int sphinx_bench_profile(struct sphinx_sockprofile *prof, const char *grammar, int rounds,
+								int *act_ms, int *fin_ms)
+{
+	struct ast_speech *speech;
+	struct sphinx_state *ss;
+	struct sphinx_request sr;
+	struct timeval t;
+	char silence[320] = { 0, };
+	int i, j, res = SPHINX_ERROR;
+	long long act_us = 0, fin_us = 0;
+
+	if ((speech = ast_speech_new(SPHINX_ENGINE_INFO.name, AST_FORMAT_SLINEAR)) == NULL)
+		return SPHINX_ERROR;
+
+	ast_mutex_lock(&speech->lock);
+	ss = (struct sphinx_state *) speech->data;
+	ss->sock = *prof;
+	if (sphinx_connect(speech, &backends[0]) != SPHINX_SUCCESS)
+		goto done;
+
+	for (i = 0; i < rounds; i++) {
+		t = ast_tvnow();
+		if (sphinx_activate(speech, (char *) grammar))
+			goto done;
+		act_us += ast_tvdiff_us(ast_tvnow(), t);
+
+		if (sphinx_start(speech))
+			goto done;
+		sr.rtype = REQTYPE_DATA;
+		sr.data = silence;
+		sr.silent = 0;
+		for (j = 0; j < 50; j++) {
+			sr.dlen = sizeof(silence);
+			if (sphinx_comm(&sr, speech, 0) != SPHINX_SUCCESS)
+				goto done;
+		}
+		sr.dlen = 0;
+		t = ast_tvnow();
+		if (sphinx_comm(&sr, speech, 1) != SPHINX_SUCCESS)
+			goto done;
+		if (speech->state == AST_SPEECH_STATE_WAIT) {
+			ast_mutex_unlock(&speech->lock);
+			j = sphinx_wait_result(speech, 5000);
+			ast_mutex_lock(&speech->lock);
+			if (j != 1)
+				goto done;
+		}
+		fin_us += ast_tvdiff_us(ast_tvnow(), t);
+	}
+	*act_ms = act_us / rounds;
+	*fin_ms = fin_us / rounds;
+	res = SPHINX_SUCCESS;
+
+done:
+	ast_mutex_unlock(&speech->lock);
+	ast_speech_destroy(speech);
+	return res;
+}
+
+/*! \brief CLI: compare socket profiles against the live server */
+static char *handle_cli_sphinx_bench_socket(struct ast_cli_entry *e, int cmd,
+											struct ast_cli_args *a)
+{
+	static const struct {
+		const char *name;
+		struct sphinx_sockprofile prof;
+	} profiles[] = {
+		{ "plain",             { 0, SPHINX_CORK_NONE, 0, 0, 0 } },
+		{ "nodelay",           { 1, SPHINX_CORK_NONE, 0, 0, 0 } },
+		{ "msgmore",           { 0, SPHINX_CORK_MSGMORE, 0, 0, 0 } },
+		{ "cork",              { 0, SPHINX_CORK_CORK, 0, 0, 0 } },
+		{ "quickack",          { 0, SPHINX_CORK_NONE, 1, 0, 0 } },
+		{ "nodelay+msgmore+quickack", { 1, SPHINX_CORK_MSGMORE, 1, 0, 0 } },
+	};
+	struct sphinx_sockprofile prof;
+	int i, rounds = 20, act_ms, fin_ms;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en benchmark socket";
+		e->usage =
+			"Usage: sphinx en benchmark socket <grammar> [rounds]\n"
+			"       Measures grammar activation and final result round trips to the\n"
+			"       configured server under each socket option, and the configured\n"
+			"       profile, averaged over rounds (default 20) utterances of silence.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc < 5 || a->argc > 6 || (a->argc == 6 && sscanf(a->argv[5], "%d", &rounds) != 1)
+		|| rounds < 1)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "%-26s %12s %12s\n", "Profile", "Activate ms", "Finish ms");
+	for (i = 0; i <= ARRAY_LEN(profiles); i++) {
+		prof = i < ARRAY_LEN(profiles) ? profiles[i].prof : SPHINX_SOCKPROFILE;
+		if (sphinx_bench_profile(&prof, a->argv[4], rounds, &act_ms, &fin_ms) != SPHINX_SUCCESS)
+			ast_cli(a->fd, "%-26s %12s %12s\n", i < ARRAY_LEN(profiles) ? profiles[i].name : "configured",
+					"failed", "failed");
+		else
+			ast_cli(a->fd, "%-26s %12d %12d\n", i < ARRAY_LEN(profiles) ? profiles[i].name : "configured",
+					act_ms, fin_ms);
+	}
+	return CLI_SUCCESS;
+}
+
+/*! \brief
+ * CLI: run a file through the front end and write the cepstra as a Sphinx
+ * .mfc file (big-endian float count, then big-endian floats), so they can be
+ * compared against sphinx_fe output for the same audio.
+ */
+static char *handle_cli_sphinx_features(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct sphinx_fe fe;
+	int16_t samples[SPHINX_FE_SHIFT * 10];
+	float cep[12 * SPHINX_FE_NCEP];
+	FILE *in, *out;
+	long left, n;
+	uint32_t count = 0, v;
+	int i, frames;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en features";
+		e->usage =
+			"Usage: sphinx en features <audio> <output.mfc>\n"
+			"       Computes the cepstra this module sends when features are\n"
+			"       negotiated for an 8 kHz WAV or raw slin file, and writes\n"
+			"       them in Sphinx .mfc format for comparison with sphinx_fe.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 5)
+		return CLI_SHOWUSAGE;
+
+	if ((in = fopen(a->argv[3], "r")) == NULL) {
+		ast_cli(a->fd, "Cannot open %s: %s\n", a->argv[3], strerror(errno));
+		return CLI_FAILURE;
+	}
+	if ((left = sphinx_bulk_open(in, a->argv[3])) < 0) {
+		ast_cli(a->fd, "%s is not 8 kHz 16-bit mono WAV or raw slin\n", a->argv[3]);
+		fclose(in);
+		return CLI_FAILURE;
+	}
+	if ((out = fopen(a->argv[4], "w")) == NULL) {
+		ast_cli(a->fd, "Cannot create %s: %s\n", a->argv[4], strerror(errno));
+		fclose(in);
+		return CLI_FAILURE;
+	}
+
+	/* Count is patched in at the end */
+	fwrite(&count, sizeof(count), 1, out);
+	memset(&fe, 0, sizeof(fe));
+	for (;;) {
+		n = left > 0 ? fread(samples, 1, MIN(left, sizeof(samples)), in) : 0;
+		left -= n;
+		frames = sphinx_fe_process(&fe, samples, n / 2, cep);
+		if (n <= 0)
+			frames += sphinx_fe_flush(&fe, cep + frames * SPHINX_FE_NCEP);
+		for (i = 0; i < frames * SPHINX_FE_NCEP; i++) {
+			memcpy(&v, &cep[i], sizeof(v));
+			v = htonl(v);
+			fwrite(&v, sizeof(v), 1, out);
+		}
+		count += frames * SPHINX_FE_NCEP;
+		if (n <= 0)
+			break;
+	}
+	v = htonl(count);
+	fseek(out, 0, SEEK_SET);
+	fwrite(&v, sizeof(v), 1, out);
+	fclose(out);
+	fclose(in);
+
+	ast_cli(a->fd, "Wrote %u frames of %d cepstra to %s\n", count / SPHINX_FE_NCEP,
+			SPHINX_FE_NCEP, a->argv[4]);
+	return CLI_SUCCESS;
+}
+
+#ifdef HAVE_SPHINXBASE
+/*! \brief Largest difference from sphinxbase allowed in any cepstrum: it works in double, we in float */
+#define SPHINX_FE_TOLERANCE 0.001
+/*! \brief Length of the parity input, samples */
+#define SPHINX_FE_CHECKLEN (SPHINX_FE_RATE * 2)
+
+/*! \brief CLI: compare our front end with sphinxbase's on a fixed input */
+static char *handle_cli_sphinx_check_features(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct sphinx_fe fe;
+	static int16_t samples[SPHINX_FE_CHECKLEN];
+	static float ours[SPHINX_FE_CHECKLEN / SPHINX_FE_SHIFT * SPHINX_FE_NCEP];
+	static mfcc_t theirs[SPHINX_FE_CHECKLEN / SPHINX_FE_SHIFT][SPHINX_FE_NCEP];
+	mfcc_t *rows[SPHINX_FE_CHECKLEN / SPHINX_FE_SHIFT];
+	const int16 *in = samples;
+	size_t left = SPHINX_FE_CHECKLEN;
+	unsigned int seed = 1;
+	double phase = 0, err, worst = 0;
+	int32 nframes = ARRAY_LEN(rows), frameidx;
+	int i, j, frames, worst_frame = 0, worst_cep = 0;
+	cmd_ln_t *config;
+	fe_t *sfe;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en check features";
+		e->usage =
+			"Usage: sphinx en check features\n"
+			"       Runs two seconds of a fixed chirp over noise through this module's\n"
+			"       front end and through sphinxbase's fe_process_frames() with the\n"
+			"       same parameters, and fails if any cepstrum differs by more than 0.001.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	/* A chirp across the filterbank over low noise, so that every band has energy */
+	for (i = 0; i < SPHINX_FE_CHECKLEN; i++) {
+		phase += 2 * M_PI * (SPHINX_FE_LOWERF + (SPHINX_FE_UPPERF - SPHINX_FE_LOWERF) * i / SPHINX_FE_CHECKLEN) /
+			SPHINX_FE_RATE;
+		seed = seed * 1103515245 + 12345;
+		samples[i] = 8000 * sin(phase) + (int) ((seed >> 16) % 1000) - 500;
+	}
+
+	memset(&fe, 0, sizeof(fe));
+	frames = sphinx_fe_process(&fe, samples, SPHINX_FE_CHECKLEN, ours);
+
+	config = cmd_ln_init(NULL, fe_get_args(), TRUE, "-samprate", "8000", "-frate", "100",
+						 "-wlen", "0.025625", "-nfft", "256", "-alpha", "0.97", "-nfilt", "31",
+						 "-lowerf", "200", "-upperf", "3500", "-ncep", "13", "-transform", "legacy",
+						 "-lifter", "0", "-dither", "no", "-remove_dc", "no", "-remove_noise", "no",
+						 "-remove_silence", "no", "-round_filters", "yes", "-unit_area", "yes", NULL);
+	if (config == NULL || (sfe = fe_init_auto_r(config)) == NULL) {
+		if (config != NULL)
+			cmd_ln_free_r(config);
+		ast_cli(a->fd, "Cannot set up the sphinxbase front end\n");
+		return CLI_FAILURE;
+	}
+	for (i = 0; i < ARRAY_LEN(rows); i++)
+		rows[i] = theirs[i];
+	fe_start_utt(sfe);
+	fe_process_frames(sfe, &in, &left, rows, &nframes, &frameidx);
+	fe_free(sfe);
+	cmd_ln_free_r(config);
+
+	if (nframes != frames)
+		ast_cli(a->fd, "Frame count differs: %d here, %d from sphinxbase\n", frames, (int) nframes);
+	for (i = 0; i < MIN(frames, nframes); i++) {
+		for (j = 0; j < SPHINX_FE_NCEP; j++) {
+			err = fabs(ours[i * SPHINX_FE_NCEP + j] - theirs[i][j]);
+			if (err > worst) {
+				worst = err;
+				worst_frame = i;
+				worst_cep = j;
+			}
+		}
+	}
+	ast_cli(a->fd, "Frames:    %d\n", MIN(frames, nframes));
+	ast_cli(a->fd, "Max error: %g in c%d of frame %d (tolerance %g)\n", worst, worst_cep, worst_frame,
+			SPHINX_FE_TOLERANCE);
+	if (nframes != frames || worst > SPHINX_FE_TOLERANCE) {
+		ast_cli(a->fd, "FAIL\n");
+		return CLI_FAILURE;
+	}
+	ast_cli(a->fd, "PASS\n");
+	return CLI_SUCCESS;
+}
+#endif
+
+/*! \brief
+ * Server stand-in for the frame benchmark: answers every legacy request, and
+ * checks that the stream is exactly what the session meant to send, so that
+ * with 'sphinx en faults' on a corrupted or desynchronised stream is caught.
+ */
+struct bench_peer {
+	int s;
+	char buf[SPHINX_BUFSIZE * 2];
+	int used;
+	int features;				/* DATA carries cepstra, only their size is checked */
+	unsigned int seed;			/* Generator state for the next expected frame */
+	int next;					/* Its number */
+	int requests;
+	int shed;					/* Silent frames the session dropped */
+	int finished;				/* Utterance ended */
+	char bad[128];				/* Why the stream stopped making sense */
+};
+
+/*! \brief Benchmark frame i: half a second of noise, then half a second of silence */
+static void sphinx_bench_frame(int16_t *frame, int samples, int i, unsigned int *seed)
+{
+	int j;
+
+	for (j = 0; j < samples; j++) {
+		*seed = *seed * 1103515245 + 12345;
+		frame[j] = (i / 25) % 2 ? 0 : (int16_t) ((*seed >> 16) % 8000) - 4000;
+	}
+}
+
+/*! \brief Check one request against what the benchmark sent; 0 if it does not belong */
+static int sphinx_bench_check(struct bench_peer *peer, int dlen, int rtype, const char *data)
+{
+	int16_t want[160];
+	int skip;
+
+	if (rtype != REQTYPE_DATA) {
+		snprintf(peer->bad, sizeof(peer->bad), "request %d has type %d", peer->requests, rtype);
+		return 0;
+	}
+	if (peer->finished) {
+		snprintf(peer->bad, sizeof(peer->bad), "request %d after the utterance ended", peer->requests);
+		return 0;
+	}
+	if (dlen == 0) {
+		peer->finished = 1;
+		return 1;
+	}
+	if (peer->features) {
+		if (dlen % (SPHINX_FE_NCEP * sizeof(float))) {
+			snprintf(peer->bad, sizeof(peer->bad), "request %d holds %d bytes of cepstra",
+					 peer->requests, dlen);
+			return 0;
+		}
+		return 1;
+	}
+	if (dlen != sizeof(want)) {
+		snprintf(peer->bad, sizeof(peer->bad), "request %d holds %d bytes, not a frame",
+				 peer->requests, dlen);
+		return 0;
+	}
+	/* Frames the VAD called silent may have been shed under overload, the rest arrive in order */
+	for (skip = 0; skip <= SPHINX_MAXQFRAMES; skip++) {
+		sphinx_bench_frame(want, ARRAY_LEN(want), peer->next, &peer->seed);
+		peer->next++;
+		if (!memcmp(want, data, sizeof(want))) {
+			peer->shed += skip;
+			return 1;
+		}
+	}
+	snprintf(peer->bad, sizeof(peer->bad), "request %d matches none of frames %d-%d",
+			 peer->requests, peer->next - skip, peer->next - 1);
+	return 0;
+}
+
+/*! \brief Read what the session sent, answer each complete request with a result */
+static void sphinx_bench_serve(struct bench_peer *peer)
+{
+	const int hlen = sizeof(int) + sizeof(enum e_reqtype);
+	char resp[sizeof(int32_t) * 2 + 5];
+	enum e_reqtype rtype;
+	int n, dlen, off = 0;
+
+	if (peer->bad[0])
+		return;
+	while ((n = read(peer->s, peer->buf + peer->used, sizeof(peer->buf) - peer->used)) > 0)
+		peer->used += n;
+	while (peer->used - off >= hlen) {
+		memcpy(&dlen, peer->buf + off, sizeof(dlen));
+		memcpy(&rtype, peer->buf + off + sizeof(dlen), sizeof(rtype));
+		if (dlen < 0 || dlen > SPHINX_BUFSIZE) {
+			snprintf(peer->bad, sizeof(peer->bad), "request %d claims %d bytes", peer->requests, dlen);
+			return;
+		}
+		if (peer->used - off < hlen + dlen)
+			break;
+		if (!sphinx_bench_check(peer, dlen, rtype, peer->buf + off + hlen))
+			return;
+		peer->requests++;
+		off += hlen + dlen;
+		n = sizeof(int32_t) + 5;
+		memcpy(resp, &n, sizeof(n));
+		n = 1;
+		memcpy(resp + sizeof(int32_t), &n, sizeof(n));
+		memcpy(resp + 2 * sizeof(int32_t), "bench", 5);
+		if (write(peer->s, resp, sizeof(resp)) != sizeof(resp))
+			break;
+	}
+	memmove(peer->buf, peer->buf + off, peer->used - off);
+	peer->used -= off;
+}
+
+#ifdef SPHINX_COUNT_ALLOCS
+/*! \brief
+ * Heap allocations this module has made on the calling thread.  The Makefile
+ * links with --wrap for each allocator, so every call from this module comes
+ * through here first, ast_malloc() and friends included where they are inlined
+ * as AST_INLINE_API normally does.  Allocations inside the Asterisk core (or
+ * all of them under MALLOC_DEBUG) are not seen.  volatile: the compiler knows
+ * malloc() leaves globals alone.
+ */
+static __thread volatile unsigned long alloc_count;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+char *__real_strndup(const char *s, size_t n);
+
+__attribute__((visibility("hidden"))) void *__wrap_malloc(size_t size)
+{
+	alloc_count++;
+	return __real_malloc(size);
+}
+
+__attribute__((visibility("hidden"))) void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __real_calloc(nmemb, size);
+}
+
+__attribute__((visibility("hidden"))) void *__wrap_realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __real_realloc(ptr, size);
+}
+
+__attribute__((visibility("hidden"))) char *__wrap_strdup(const char *s)
+{
+	alloc_count++;
+	return __real_strdup(s);
+}
+
+__attribute__((visibility("hidden"))) char *__wrap_strndup(const char *s, size_t n)
+{
+	alloc_count++;
+	return __real_strndup(s, n);
+}
+#endif
+
+/*! \brief
+ * CLI: time the per-frame path, sphinx_write() through silence detection,
+ * request encoding, buffering and response parsing, against a socketpair
+ * stand-in for the server, so nothing but our own code and its syscalls is
+ * measured.
+ */
+static char *handle_cli_sphinx_bench_frames(struct ast_cli_entry *e, int cmd,
+											struct ast_cli_args *a)
+{
+	struct ast_speech *speech;
+	struct sphinx_state *ss;
+	struct bench_peer peer = { 0, };
+	int16_t frame[160];
+	int sv[2], i, j, frames = 50000, features = 0, res = 0;
+	unsigned int seed = 1;
+#ifdef SPHINX_COUNT_ALLOCS
+	unsigned long allocs;
+#endif
+	struct timespec t0, t1, p0, p1;
+	long long total_ns, peer_ns = 0;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en benchmark frames";
+		e->usage =
+			"Usage: sphinx en benchmark frames [count] [features]\n"
+			"       Pushes count (default 50000) 20 ms frames of alternating noise\n"
+			"       and silence through sphinx_write() against a local stand-in\n"
+			"       server and reports the cost per frame, optionally with\n"
+			"       client-side features.  The stand-in checks every request it\n"
+			"       gets, so with 'sphinx en faults' on, a session that corrupts its\n"
+			"       stream or gets stuck is reported.  Allocations are the calls this\n"
+			"       module makes to malloc() and friends on the way, counted when it\n"
+			"       is built by its Makefile; the Asterisk core's own are not seen.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc < 4 || a->argc > 6)
+		return CLI_SHOWUSAGE;
+	for (i = 4; i < a->argc; i++) {
+		if (!strcasecmp(a->argv[i], "features"))
+			features = 1;
+		else if (sscanf(a->argv[i], "%d", &frames) != 1 || frames < 1)
+			return CLI_SHOWUSAGE;
+	}
+
+	if ((speech = ast_calloc(1, sizeof(*speech))) == NULL)
+		return CLI_FAILURE;
+	ast_mutex_init(&speech->lock);
+	if (reinit_speech_data(speech) != SPHINX_SUCCESS ||
+		socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		ast_cli(a->fd, "Cannot set up the benchmark session\n");
+		destroy_speech_data(speech);
+		ast_mutex_destroy(&speech->lock);
+		ast_free(speech);
+		return CLI_FAILURE;
+	}
+	ss = (struct sphinx_state *) speech->data;
+	ss->s = sv[0];
+	sphinx_set_blocking(sv[0], 0);
+	sphinx_set_blocking(sv[1], 0);
+	peer.s = sv[1];
+	peer.seed = seed;
+	peer.features = features;
+	if (features)
+		ss->caps |= SPHINX_CAP_FEATURES;
+	/* Keep the one utterance going however long the silences are, or the whole run takes */
+	ss->endpoint = INT_MAX;
+	ss->stablefinish = 0;
+	ss->deadline = 0;
+	ast_speech_change_state(speech, AST_SPEECH_STATE_READY);
+
+#ifdef SPHINX_COUNT_ALLOCS
+	allocs = alloc_count;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < frames && !res && !peer.bad[0]; i++) {
+		sphinx_bench_frame(frame, ARRAY_LEN(frame), i, &seed);
+		res = sphinx_write(speech, frame, sizeof(frame));
+
+		clock_gettime(CLOCK_MONOTONIC, &p0);
+		sphinx_bench_serve(&peer);
+		clock_gettime(CLOCK_MONOTONIC, &p1);
+		peer_ns += (p1.tv_sec - p0.tv_sec) * 1000000000LL + (p1.tv_nsec - p0.tv_nsec);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+#ifdef SPHINX_COUNT_ALLOCS
+	allocs = alloc_count - allocs;
+#endif
+	total_ns = (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec) - peer_ns;
+
+	/* Everything sent must get through and be answered within a couple of seconds */
+	for (j = 0; !res && !peer.bad[0] && (ss->pwbytes || ss->preads || ss->prbytes) && j < 2000; j++) {
+		if ((ss->pwbytes && sphinx_swrite(ss, NULL, 0) != SPHINX_SUCCESS) ||
+			sphinx_sread(ss, speech) != SPHINX_SUCCESS)
+			res = -1;
+		sphinx_bench_serve(&peer);
+		if (ss->pwbytes || ss->preads || ss->prbytes)
+			usleep(1000);
+	}
+
+	if (res)
+		ast_cli(a->fd, "Session failed after %d frames\n", i);
+	if (peer.bad[0])
+		ast_cli(a->fd, "DESYNC:      %s\n", peer.bad);
+	else if (!res && (ss->pwbytes || ss->preads || ss->prbytes))
+		ast_cli(a->fd, "STUCK:       %d responses and %d bytes still owed after 2 s\n",
+				ss->preads, ss->pwbytes);
+	ast_cli(a->fd, "Checked:     %d requests, %d silent frames shed\n", peer.requests, peer.shed);
+	ast_cli(a->fd, "Frames:      %d (%s)\n", i, features ? "features" : "audio");
+	ast_cli(a->fd, "Per frame:   %lld ns (stand-in server excluded)\n", total_ns / MAX(i, 1));
+#ifdef SPHINX_COUNT_ALLOCS
+	ast_cli(a->fd, "Allocations: %lu, %.3f per frame\n", allocs, (double) allocs / MAX(i, 1));
+#else
+	ast_cli(a->fd, "Allocations: not counted, build with the module's Makefile\n");
+#endif
+	ast_cli(a->fd, "Pending:     %d responses, %d bytes unsent\n", ss->preads, ss->pwbytes);
+
+	if (speech->results)
+		ast_speech_results_free(speech->results);
+	sphinx_disconnect(speech);
+	destroy_speech_data(speech);
+	close(sv[1]);
+	ast_mutex_destroy(&speech->lock);
+	ast_free(speech);
+	return CLI_SUCCESS;
+}
+
+/*! \brief CLI: turn fault injection on or off */
+static char *handle_cli_sphinx_faults(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct sphinx_faults f = { 0, };
+	char *spec, *opt, *val;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en faults";
+		e->usage =
+			"Usage: sphinx en faults {off|<name>=<value>[,...]}\n"
+			"       Injects network faults into every session's socket I/O, to\n"
+			"       exercise partial reads and writes, retries and error paths\n"
+			"       under load, e.g. from 'sphinx en transcribe'.  Never on a\n"
+			"       production system: delays block the calling channel.\n"
+			"         fragment=N    move at most N bytes per read or write\n"
+			"         shortwrite=P  cut P% of writes short\n"
+			"         eagain=P      fail P% of calls with EAGAIN\n"
+			"         storm=N       ... and the N calls after each of those\n"
+			"         delay=MS      add MS to every call\n"
+			"         jitter=MS     add up to MS more at random\n"
+			"         reset=N       reset the connection on N calls per million\n"
+			"         loss=P        drop P% of audio datagrams\n"
+			"         reorder=P     send P% of audio datagrams after the next one\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	if (!strcasecmp(a->argv[3], "off")) {
+		sphinx_io = &sphinx_io_plain;
+		fault_cfg = f;
+		ast_cli(a->fd, "Fault injection off\n");
+		return CLI_SUCCESS;
+	}
+
+	spec = ast_strdupa(a->argv[3]);
+	while ((opt = strsep(&spec, ","))) {
+		if ((val = strchr(opt, '=')) == NULL || sscanf(val + 1, "%d", &i) != 1 || i < 0) {
+			ast_cli(a->fd, "Bad fault '%s'\n", opt);
+			return CLI_SHOWUSAGE;
+		}
+		*val = '\0';
+		if (!strcasecmp(opt, "fragment"))
+			f.fragment = i;
+		else if (!strcasecmp(opt, "shortwrite"))
+			f.shortwrite = i;
+		else if (!strcasecmp(opt, "eagain"))
+			f.eagain = i;
+		else if (!strcasecmp(opt, "storm"))
+			f.storm = i;
+		else if (!strcasecmp(opt, "delay"))
+			f.delay = i;
+		else if (!strcasecmp(opt, "jitter"))
+			f.jitter = i;
+		else if (!strcasecmp(opt, "reset"))
+			f.reset = i;
+		else if (!strcasecmp(opt, "loss"))
+			f.loss = i;
+		else if (!strcasecmp(opt, "reorder"))
+			f.reorder = i;
+		else {
+			ast_cli(a->fd, "Unknown fault '%s'\n", opt);
+			return CLI_SHOWUSAGE;
+		}
+	}
+
+	fault_cfg = f;
+	memset(&fault_stats, 0, sizeof(fault_stats));
+	sphinx_io = &sphinx_io_faulty;
+	ast_log(LOG_WARNING, "Sphinx fault injection on: %s\n", a->argv[3]);
+	return CLI_SUCCESS;
+}
+
+/*! \brief CLI: what fault injection has done so far */
+static char *handle_cli_sphinx_show_faults(struct ast_cli_entry *e, int cmd,
+										   struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show faults";
+		e->usage =
+			"Usage: sphinx en show faults\n"
+			"       Shows the injected faults and how often each fired.  Compare\n"
+			"       with 'sphinx en show servers' and 'sphinx en show latency'.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "Injection:     %s\n", sphinx_io == &sphinx_io_faulty ? "on" : "off");
+	ast_cli(a->fd, "Settings:      fragment=%d shortwrite=%d eagain=%d storm=%d delay=%d jitter=%d reset=%d"
+			" loss=%d reorder=%d\n", fault_cfg.fragment, fault_cfg.shortwrite, fault_cfg.eagain,
+			fault_cfg.storm, fault_cfg.delay, fault_cfg.jitter, fault_cfg.reset, fault_cfg.loss,
+			fault_cfg.reorder);
+	ast_cli(a->fd, "Calls:         %d\n", fault_stats.calls);
+	ast_cli(a->fd, "Fragmented:    %d\n", fault_stats.fragmented);
+	ast_cli(a->fd, "Short writes:  %d\n", fault_stats.short_writes);
+	ast_cli(a->fd, "EAGAIN:        %d\n", fault_stats.eagains);
+	ast_cli(a->fd, "Delayed:       %d\n", fault_stats.delayed);
+	ast_cli(a->fd, "Resets:        %d\n", fault_stats.resets);
+	ast_cli(a->fd, "Lost:          %d datagrams\n", fault_stats.lost);
+	ast_cli(a->fd, "Reordered:     %d datagrams\n", fault_stats.reordered);
+	return CLI_SUCCESS;
+}
+
+/*! \brief CLI: admission control */
+static char *handle_cli_sphinx_show_admission(struct ast_cli_entry *e, int cmd,
+											  struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show admission";
+		e->usage =
+			"Usage: sphinx en show admission\n"
+			"       Shows the session budget, its wait queue and how many sessions\n"
+			"       were refused.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_mutex_lock(&admit_lock);
+	if (SPHINX_MAX_SESSIONS)
+		ast_cli(a->fd, "Sessions:  %d of %d\n", admit_stats.active, SPHINX_MAX_SESSIONS);
+	else
+		ast_cli(a->fd, "Sessions:  %d (no limit)\n", admit_stats.active);
+	ast_cli(a->fd, "Waiting:   %d of %d (most %d, up to %d ms)\n", admit_stats.waiting,
+			SPHINX_ADMIT_QUEUE, admit_stats.waiting_hwm, SPHINX_ADMIT_WAIT);
+	ast_cli(a->fd, "Admitted:  %d (%d after waiting)\n", admit_stats.admitted, admit_stats.waited);
+	ast_cli(a->fd, "Classes:   interactive %d admitted, %d waiting; batch %d admitted, %d waiting"
+			" (weight %d)\n", admit_stats.byclass[SPHINX_PRIO_INTERACTIVE],
+			admit_waiting[SPHINX_PRIO_INTERACTIVE], admit_stats.byclass[SPHINX_PRIO_BATCH],
+			admit_waiting[SPHINX_PRIO_BATCH], SPHINX_PRIORITY_WEIGHT);
+	ast_cli(a->fd, "Rejected:  %d (queue full)\n", admit_stats.rejected);
+	ast_cli(a->fd, "Timed out: %d\n", admit_stats.timedout);
+	ast_mutex_unlock(&admit_lock);
+	return CLI_SUCCESS;
+}
+
+/*! \brief CLI: shadow traffic */
+static char *handle_cli_sphinx_show_shadow(struct ast_cli_entry *e, int cmd,
+										   struct ast_cli_args *a)
+{
+	unsigned int queued;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show shadow";
+		e->usage =
+			"Usage: sphinx en show shadow\n"
+			"       Shows how much traffic is mirrored to the canary recognizer and\n"
+			"       how its results compare with production's.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	if (shadow_thread == AST_PTHREADT_NULL) {
+		ast_cli(a->fd, "Shadow traffic is off\n");
+		return CLI_SUCCESS;
+	}
+	queued = __atomic_load_n(&shadow_head, __ATOMIC_RELAXED) - shadow_tail;
+	ast_cli(a->fd, "Canary:    %s, %d%% of sessions\n", SPHINX_SHADOW_SERVER, SPHINX_SHADOW_RATE);
+	ast_cli(a->fd, "Queued:    %u of %u records\n", queued, shadow_mask + 1);
+	ast_cli(a->fd, "Sessions:  %d mirrored, %d open on the canary, %d given up on\n",
+			shadow_stats.sessions, shadow_stats.open, shadow_stats.lost);
+	ast_cli(a->fd, "Dropped:   %d records (queue full)\n", shadow_stats.dropped);
+	ast_cli(a->fd, "Compared:  %d, %d the same\n", shadow_stats.compared, shadow_stats.matched);
+	ast_cli(a->fd, "Latency:   production %d ms, canary %d ms average; canary slower %d times\n",
+			shadow_stats.compared ? shadow_stats.prod_ms / shadow_stats.compared : 0,
+			shadow_stats.compared ? shadow_stats.canary_ms / shadow_stats.compared : 0,
+			shadow_stats.slower);
+	return CLI_SUCCESS;
+}
+
+/*! \brief CLI: local decoder status */
+static char *handle_cli_sphinx_show_local(struct ast_cli_entry *e, int cmd,
+										  struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show local";
+		e->usage =
+			"Usage: sphinx en show local\n"
+			"       Shows the in-process decoder pool and what it has decoded.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "Grammars:  %s\n", S_OR(SPHINX_LOCAL_GRAMMARS, "(none)"));
+	ast_cli(a->fd, "Workers:   %d running of %d\n", local_running, SPHINX_LOCAL_WORKERS);
+#ifdef HAVE_POCKETSPHINX
+	ast_cli(a->fd, "Queued:    %d of %d (%d batch)\n", local_queued, SPHINX_LOCAL_QUEUE,
+			local_waiting[SPHINX_PRIO_BATCH]);
+#else
+	ast_cli(a->fd, "Queued:    %d of %d\n", local_queued, SPHINX_LOCAL_QUEUE);
+#endif
+	ast_cli(a->fd, "Decoded:   %d (average %d ms)\n", local_stats.decoded,
+			local_stats.decoded ? local_stats.total_ms / local_stats.decoded : 0);
+	ast_cli(a->fd, "Failed:    %d\n", local_stats.failed);
+	ast_cli(a->fd, "Rejected:  %d\n", local_stats.rejected);
+	ast_cli(a->fd, "Cancelled: %d\n", local_stats.cancelled);
+	return CLI_SUCCESS;
+}
+
+/*! \brief CLI: learned endpoints */
+static char *handle_cli_sphinx_show_endpoints(struct ast_cli_entry *e, int cmd,
+											  struct ast_cli_args *a)
+{
+	struct sphinx_endpoint_stats *es;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show endpoints";
+		e->usage =
+			"Usage: sphinx en show endpoints\n"
+			"       Shows per-grammar pause statistics and the silence timeout\n"
+			"       learned from them.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "Learning: %s, bounds %d-%d ms, after %d utterances, default %d ms\n",
+			SPHINX_LEARN_ENDPOINT ? "on" : "off", SPHINX_LEARN_MIN, SPHINX_LEARN_MAX,
+			SPHINX_LEARN_SAMPLES, SPHINX_SILENCE_TIME);
+	ast_cli(a->fd, "%-24s %10s %10s %10s %10s %10s\n", "Grammar", "Utterances", "Avg ms",
+			"Pause p50", "Pause p95", "Timeout");
+	ast_mutex_lock(&endpoint_lock);
+	AST_LIST_TRAVERSE(&endpoint_list, es, list) {
+		if (!es->utterances)
+			continue;
+		ast_cli(a->fd, "%-24s %10d %10lld %10d %10d %10d\n", es->grammar, es->utterances,
+				es->speech_ms / es->utterances, sphinx_endpoint_percentile(es, 50),
+				sphinx_endpoint_percentile(es, 95), es->endpoint ? es->endpoint : SPHINX_SILENCE_TIME);
+	}
+	ast_mutex_unlock(&endpoint_lock);
+	return CLI_SUCCESS;
+}
+
+/*! \brief CLI: per-server traffic and health */
+static char *handle_cli_sphinx_show_servers(struct ast_cli_entry *e, int cmd,
+											struct ast_cli_args *a)
+{
+	struct sphinx_counters c;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show servers";
+		e->usage =
+			"Usage: sphinx en show servers\n"
+			"       Shows traffic, buffer high-water marks and errors per server.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	if (SPHINX_DATAGRAM)
+		ast_cli(a->fd, "Datagrams:  %d sent, %d dropped for want of buffer space, "
+				"%d sessions back on the stream\n", dgram_stats.sent, dgram_stats.dropped,
+				dgram_stats.fallbacks);
+	for (i = 0; i < nbackends; i++) {
+		sphinx_stat_sum(&backends[i], &c);
+		ast_cli(a->fd, "Server %s:%d\n", backends[i].host, backends[i].port);
+		ast_cli(a->fd, "  Sessions:        %d\n", backends[i].sessions);
+		ast_cli(a->fd, "  Routed:          %d (%d spilled from their grammar's server)\n",
+				backends[i].routed, backends[i].spilled);
+		ast_cli(a->fd, "  Breaker:         %s (%d failures, %d sessions refused)\n",
+				breaker_names[backends[i].breaker], backends[i].failures, backends[i].rejected);
+		ast_cli(a->fd, "  Requests:        %llu (%llu audio frames)\n",
+				(unsigned long long) c.requests, (unsigned long long) c.frames);
+		ast_cli(a->fd, "  Responses:       %llu\n", (unsigned long long) c.responses);
+		ast_cli(a->fd, "  Bytes sent:      %llu\n", (unsigned long long) c.bytes_sent);
+		ast_cli(a->fd, "  Bytes received:  %llu\n", (unsigned long long) c.bytes_recv);
+		ast_cli(a->fd, "  Syscalls:        %llu\n", (unsigned long long) c.syscalls);
+		ast_cli(a->fd, "  Partial writes:  %llu\n", (unsigned long long) c.partial_writes);
+		ast_cli(a->fd, "  Send buffer HWM: %d of %d\n", c.pwbytes_hwm, SPHINX_BUFSIZE);
+		ast_cli(a->fd, "  Recv buffer HWM: %d of %d\n", c.rbufused_hwm, SPHINX_BUFSIZE);
+		ast_cli(a->fd, "  Overflows:       %llu\n", (unsigned long long) c.overflows);
+		ast_cli(a->fd, "  Timeouts:        %llu\n", (unsigned long long) c.timeouts);
+		ast_cli(a->fd, "  Errors:          %llu\n", (unsigned long long) c.errors);
+	}
+	return CLI_SUCCESS;
+}
+
+/*! \brief AMI: per-server traffic and health, one event per server */
+static int manager_sphinx_servers(struct mansession *s, const struct message *m)
+{
+	const char *id = astman_get_header(m, "ActionID");
+	char idtext[256] = "";
+	struct sphinx_counters c;
+	int i;
+
+	if (!ast_strlen_zero(id))
+		snprintf(idtext, sizeof(idtext), "ActionID: %s\r\n", id);
+
+	astman_send_listack(s, m, "Sphinx servers will follow", "start");
+	for (i = 0; i < nbackends; i++) {
+		sphinx_stat_sum(&backends[i], &c);
+		astman_append(s,
+			"Event: SphinxServer\r\n"
+			"%s"
+			"Engine: %s\r\n"
+			"Server: %s:%d\r\n"
+			"Sessions: %d\r\n"
+			"Breaker: %s\r\n"
+			"Failures: %d\r\n"
+			"Refused: %d\r\n"
+			"Requests: %llu\r\n"
+			"Frames: %llu\r\n"
+			"Responses: %llu\r\n"
+			"BytesSent: %llu\r\n"
+			"BytesReceived: %llu\r\n"
+			"Syscalls: %llu\r\n"
+			"PartialWrites: %llu\r\n"
+			"SendBufferHWM: %d\r\n"
+			"RecvBufferHWM: %d\r\n"
+			"Overflows: %llu\r\n"
+			"Timeouts: %llu\r\n"
+			"Errors: %llu\r\n"
+			"\r\n",
+			idtext, SPHINX_ENGINE_INFO.name, backends[i].host, backends[i].port,
+			backends[i].sessions, breaker_names[backends[i].breaker], backends[i].failures,
+			backends[i].rejected, (unsigned long long) c.requests,
+			(unsigned long long) c.frames, (unsigned long long) c.responses,
+			(unsigned long long) c.bytes_sent, (unsigned long long) c.bytes_recv,
+			(unsigned long long) c.syscalls, (unsigned long long) c.partial_writes,
+			c.pwbytes_hwm, c.rbufused_hwm, (unsigned long long) c.overflows,
+			(unsigned long long) c.timeouts, (unsigned long long) c.errors);
+	}
+	astman_append(s,
+		"Event: SphinxServersComplete\r\n"
+		"EventList: Complete\r\n"
+		"ListItems: %d\r\n"
+		"%s"
+		"\r\n", nbackends, idtext);
+	return 0;
+}
+
+/*! \brief CLI: capture status */
+static char *handle_cli_sphinx_show_capture(struct ast_cli_entry *e, int cmd,
+											struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "sphinx en show capture";
+		e->usage =
+			"Usage: sphinx en show capture\n"
+			"       Shows wire capture settings and writer backlog.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 4)
+		return CLI_SHOWUSAGE;
+
+	ast_cli(a->fd, "Capture:   %s\n", SPHINX_CAPTURE ? "yes" : "no");
+	ast_cli(a->fd, "Directory: %s\n", SPHINX_CAPTURE_DIR);
+	ast_cli(a->fd, "Files:     %d\n", capture_files);
+	ast_cli(a->fd, "Queued:    %d bytes (max %d)\n", capture_queued, SPHINX_CAPTURE_QUEUE);
+	ast_cli(a->fd, "Dropped:   %d records\n", capture_dropped);
+	return CLI_SUCCESS;
+}
+
+static struct ast_cli_entry sphinx_cli[] = {
+	AST_CLI_DEFINE(handle_cli_sphinx_show_overload, "Show Sphinx overload counters"),
+	AST_CLI_DEFINE(handle_cli_sphinx_show_latency, "Show Sphinx result latency"),
+	AST_CLI_DEFINE(handle_cli_sphinx_show_capture, "Show Sphinx wire capture status"),
+	AST_CLI_DEFINE(handle_cli_sphinx_replay, "Replay a Sphinx wire capture"),
+	AST_CLI_DEFINE(handle_cli_sphinx_transcribe, "Transcribe recorded audio with Sphinx"),
+	AST_CLI_DEFINE(handle_cli_sphinx_bench_socket, "Benchmark Sphinx socket options"),
+	AST_CLI_DEFINE(handle_cli_sphinx_bench_frames, "Benchmark the Sphinx per-frame path"),
+	AST_CLI_DEFINE(handle_cli_sphinx_show_servers, "Show Sphinx server counters"),
+	AST_CLI_DEFINE(handle_cli_sphinx_features, "Dump client-side Sphinx features"),
+#ifdef HAVE_SPHINXBASE
+	AST_CLI_DEFINE(handle_cli_sphinx_check_features, "Compare Sphinx features with sphinxbase"),
+#endif
+	AST_CLI_DEFINE(handle_cli_sphinx_show_endpoints, "Show learned Sphinx endpoints"),
+	AST_CLI_DEFINE(handle_cli_sphinx_show_local, "Show the local Sphinx decoder"),
+	AST_CLI_DEFINE(handle_cli_sphinx_show_admission, "Show Sphinx admission control"),
+	AST_CLI_DEFINE(handle_cli_sphinx_show_shadow, "Show Sphinx shadow traffic"),
+	AST_CLI_DEFINE(handle_cli_sphinx_faults, "Inject Sphinx network faults"),
+	AST_CLI_DEFINE(handle_cli_sphinx_show_faults, "Show Sphinx fault injection"),
+};
+
+/*! \brief
+ * Reads responses for a session that has sent its final request.  Lock order
+ * elsewhere is speech->lock then notify_lock, so we only try for speech->lock.
+ */
+static void sphinx_notify_deliver(struct sphinx_state *target)
+{
+	struct sphinx_state *ss;
+	struct ast_speech *speech;
+
+	for (;;) {
+		ast_mutex_lock(&notify_lock);
+		AST_LIST_TRAVERSE(&notify_list, ss, notify_entry) {
+			if (ss == target)
+				break;
+		}
+		if (ss == NULL) {		/* Taken back (or destroyed) meanwhile */
+			ast_mutex_unlock(&notify_lock);
+			return;
+		}
+		if (!ast_mutex_trylock(&ss->speech->lock))
+			break;
+		ast_mutex_unlock(&notify_lock);
+		usleep(1);
+	}
+
+	speech = ss->speech;
+	if (sphinx_sread(ss, speech) != SPHINX_SUCCESS) {
+		ss->notifying = 0;
+		epoll_ctl(notify_epfd, EPOLL_CTL_DEL, ss->s, NULL);
+		AST_LIST_REMOVE(&notify_list, ss, notify_entry);
+		eventfd_write(ss->efd, 1);
+	} else if (!ss->preads && !ss->prbytes) {
+		ss->notifying = 0;
+		epoll_ctl(notify_epfd, EPOLL_CTL_DEL, ss->s, NULL);
+		AST_LIST_REMOVE(&notify_list, ss, notify_entry);
+		sphinx_publish_result(speech);
+	}
+
+	ast_mutex_unlock(&speech->lock);
+	ast_mutex_unlock(&notify_lock);
+}
+
+/*! \brief
+ * The final result of an utterance cut off at its deadline is overdue: have
+ * the server drop it and hand over the best hypothesis so far, which is the
+ * last partial result, if the server sent any.
+ */
+static void sphinx_deadline_expire(struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+
+	ast_log(LOG_NOTICE, "No final result %d ms after the deadline, using the best so far\n",
+			ss->deadlinewait);
+	ast_atomic_fetchadd_int(&latency_stats.abandoned, 1);
+	sphinx_cancel(speech);
+	sphinx_publish_result(speech);
+}
+
+/*! \brief Milliseconds left to wait for a final result, as the flush loop would */
+static int sphinx_result_wait(struct sphinx_state *ss, struct timeval since)
+{
+	if (ss->deadlined)
+		return ss->deadlinewait - ast_tvdiff_ms(ast_tvnow(), ss->deadline_tv);
+	return 5000 - ast_tvdiff_ms(ast_tvnow(), since);
+}
+
+/*! \brief Give up on sessions whose server went quiet, as the flush loop would */
+static void sphinx_notify_expire(void)
+{
+	struct sphinx_state *ss;
+
+	ast_mutex_lock(&notify_lock);
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&notify_list, ss, notify_entry) {
+		if (sphinx_result_wait(ss, ss->notify_tv) > 0 || ast_mutex_trylock(&ss->speech->lock))
+			continue;
+		ss->notifying = 0;
+		epoll_ctl(notify_epfd, EPOLL_CTL_DEL, ss->s, NULL);
+		AST_LIST_REMOVE_CURRENT(notify_entry);
+		if (ss->deadlined) {
+			sphinx_deadline_expire(ss->speech);
+		} else {
+			SPHINX_STAT(ss, timeouts, 1);
+			sphinx_breaker_report(ss->backend, 0);
+			make_error(ss->speech, "Reached 5-second timeout waiting for results, WTF.\n");
+			eventfd_write(ss->efd, 1);
+		}
+		ast_mutex_unlock(&ss->speech->lock);
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	ast_mutex_unlock(&notify_lock);
+}
+
+/*! \brief Result notifier thread */
+static void *sphinx_notify_thread(void *data)
+{
+	struct epoll_event ev[16];
+	int i, n;
+
+	while (!notify_stop) {
+		/* Often enough to keep deadlinewait to within a tick */
+		n = epoll_wait(notify_epfd, ev, ARRAY_LEN(ev), 200);
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.ptr != NULL)
+				sphinx_notify_deliver(ev[i].data.ptr);
+		}
+		sphinx_notify_expire();
+	}
+	return NULL;
+}
+
+/*! \brief Start the result notifier thread */
+static int sphinx_notify_start(void)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+	if ((notify_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		return SPHINX_ERROR;
+	if ((notify_wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+		epoll_ctl(notify_epfd, EPOLL_CTL_ADD, notify_wakefd, &ev) == -1 ||
+		ast_pthread_create_background(&notify_thread, NULL, sphinx_notify_thread, NULL)) {
+		if (notify_wakefd != -1)
+			close(notify_wakefd);
+		close(notify_epfd);
+		notify_wakefd = notify_epfd = -1;
+		notify_thread = AST_PTHREADT_NULL;
+		return SPHINX_ERROR;
+	}
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Stop the result notifier thread */
+static void sphinx_notify_stop(void)
+{
+	if (notify_thread == AST_PTHREADT_NULL)
+		return;
+
+	notify_stop = 1;
+	eventfd_write(notify_wakefd, 1);
+	pthread_join(notify_thread, NULL);
+	notify_thread = AST_PTHREADT_NULL;
+	close(notify_wakefd);
+	close(notify_epfd);
+	notify_wakefd = notify_epfd = -1;
+}
+
+/*! \brief load module, config settings */
+static int load_module(void)
+{
+	struct ast_flags config_flags = { 0 };
+	struct ast_config *conf = ast_config_load("sphinx_en.conf", config_flags);
+	char const *value;
+
+	if (conf == NULL) {
+		ast_log(LOG_ERROR, "Unable to load sphinx.conf\n");
+		return AST_MODULE_LOAD_FAILURE;
+	}
+
+	if ((value = ast_variable_retrieve(conf, "general", "serverip"))) {
+		ast_copy_string(SPHINX_SERVER_ADDR, value, sizeof(SPHINX_SERVER_ADDR));
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "serverport"))) {
+		sscanf(value, "%d", &SPHINX_SERVER_PORT);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "servers"))) {
+		ast_copy_string(SPHINX_SERVERS, value, sizeof(SPHINX_SERVERS));
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "routeload"))) {
+		sscanf(value, "%d", &SPHINX_ROUTE_LOAD);
+		if (SPHINX_ROUTE_LOAD < 100)
+			SPHINX_ROUTE_LOAD = 100;
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "maxsessions"))) {
+		sscanf(value, "%d", &SPHINX_MAX_SESSIONS);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "admitqueue"))) {
+		sscanf(value, "%d", &SPHINX_ADMIT_QUEUE);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "admitwait"))) {
+		sscanf(value, "%d", &SPHINX_ADMIT_WAIT);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "priority"))) {
+		int i;
+		for (i = 0; i < ARRAY_LEN(priority_names); i++) {
+			if (!strcasecmp(value, priority_names[i]))
+				break;
+		}
+		if (i < ARRAY_LEN(priority_names))
+			SPHINX_PRIORITY = i;
+		else
+			ast_log(LOG_WARNING, "Unknown priority '%s', using '%s'\n", value,
+					priority_names[SPHINX_PRIORITY]);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "priorityweight"))) {
+		sscanf(value, "%d", &SPHINX_PRIORITY_WEIGHT);
+		if (SPHINX_PRIORITY_WEIGHT < 1)
+			SPHINX_PRIORITY_WEIGHT = 1;
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "shadowserver"))) {
+		ast_copy_string(SPHINX_SHADOW_SERVER, value, sizeof(SPHINX_SHADOW_SERVER));
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "shadowrate"))) {
+		sscanf(value, "%d", &SPHINX_SHADOW_RATE);
 	}
-
-	if ((value = ast_variable_retrieve(conf, "general", "serverip"))) {
-		ast_copy_string(SPHINX_SERVER_ADDR, value, sizeof(SPHINX_SERVER_ADDR));
+	if ((value = ast_variable_retrieve(conf, "general", "shadowqueue"))) {
+		sscanf(value, "%d", &SPHINX_SHADOW_QUEUE);
+		if (SPHINX_SHADOW_QUEUE < 64)
+			SPHINX_SHADOW_QUEUE = 64;
 	}
-	if ((value = ast_variable_retrieve(conf, "general", "serverport"))) {
-		sscanf(value, "%d", &SPHINX_SERVER_PORT);
+	if ((value = ast_variable_retrieve(conf, "general", "deadline"))) {
+		sscanf(value, "%d", &SPHINX_DEADLINE);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "deadlinewait"))) {
+		sscanf(value, "%d", &SPHINX_DEADLINE_WAIT);
 	}
 	if ((value = ast_variable_retrieve(conf, "general", "silencetime"))) {
 		sscanf(value, "%d", &SPHINX_SILENCE_TIME);
@@ -144,23 +3738,215 @@ static int load_module(void)
 	if ((value = ast_variable_retrieve(conf, "general", "silencethreshold"))) {
 		sscanf(value, "%d", &SPHINX_SILENCE_THRESHOLD);
 	}
+	if ((value = ast_variable_retrieve(conf, "general", "learnendpoint"))) {
+		SPHINX_LEARN_ENDPOINT = ast_true(value);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "learnmin"))) {
+		sscanf(value, "%d", &SPHINX_LEARN_MIN);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "learnmax"))) {
+		sscanf(value, "%d", &SPHINX_LEARN_MAX);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "learnsamples"))) {
+		sscanf(value, "%d", &SPHINX_LEARN_SAMPLES);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "stablefinish"))) {
+		sscanf(value, "%d", &SPHINX_STABLE_FINISH);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "overloadpolicy"))) {
+		int i;
+		for (i = 0; i < ARRAY_LEN(overload_names); i++) {
+			if (!strcasecmp(value, overload_names[i]))
+				break;
+		}
+		if (i < ARRAY_LEN(overload_names))
+			SPHINX_OVERLOAD_POLICY = i;
+		else
+			ast_log(LOG_WARNING, "Unknown overloadpolicy '%s', using '%s'\n", value,
+					overload_names[SPHINX_OVERLOAD_POLICY]);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "overloadwait"))) {
+		sscanf(value, "%d", &SPHINX_OVERLOAD_WAIT);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "handshake"))) {
+		SPHINX_HANDSHAKE = ast_true(value);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "features"))) {
+		SPHINX_FEATURES = ast_true(value);
+		if (SPHINX_FEATURES && !SPHINX_HANDSHAKE)
+			ast_log(LOG_WARNING, "features needs handshake=yes, sending audio\n");
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "datagram"))) {
+		SPHINX_DATAGRAM = ast_true(value);
+		if (SPHINX_DATAGRAM && !SPHINX_HANDSHAKE)
+			ast_log(LOG_WARNING, "datagram needs handshake=yes, sending audio over TCP\n");
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "notify"))) {
+		SPHINX_NOTIFY = ast_true(value);
+	}
+
+	if ((value = ast_variable_retrieve(conf, "general", "nodelay"))) {
+		SPHINX_SOCKPROFILE.nodelay = ast_true(value);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "cork"))) {
+		int i;
+		for (i = 0; i < ARRAY_LEN(cork_names); i++) {
+			if (!strcasecmp(value, cork_names[i]))
+				break;
+		}
+		if (i < ARRAY_LEN(cork_names))
+			SPHINX_SOCKPROFILE.cork = i;
+		else
+			ast_log(LOG_WARNING, "Unknown cork '%s', using '%s'\n", value,
+					cork_names[SPHINX_SOCKPROFILE.cork]);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "quickack"))) {
+		SPHINX_SOCKPROFILE.quickack = ast_true(value);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "sndbuf"))) {
+		sscanf(value, "%d", &SPHINX_SOCKPROFILE.sndbuf);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "rcvbuf"))) {
+		sscanf(value, "%d", &SPHINX_SOCKPROFILE.rcvbuf);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "keepalive"))) {
+		sscanf(value, "%d", &SPHINX_SOCKPROFILE.keepidle);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "keepintvl"))) {
+		sscanf(value, "%d", &SPHINX_SOCKPROFILE.keepintvl);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "keepcnt"))) {
+		sscanf(value, "%d", &SPHINX_SOCKPROFILE.keepcnt);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "breakerfailures"))) {
+		sscanf(value, "%d", &SPHINX_BREAKER_FAILURES);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "breakercooldown"))) {
+		sscanf(value, "%d", &SPHINX_BREAKER_COOLDOWN);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "pingtimeout"))) {
+		sscanf(value, "%d", &SPHINX_PING_TIMEOUT);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "bulkworkers"))) {
+		sscanf(value, "%d", &SPHINX_BULK_WORKERS);
+		if (SPHINX_BULK_WORKERS < 1)
+			SPHINX_BULK_WORKERS = 1;
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "localgrammars"))) {
+		ast_copy_string(SPHINX_LOCAL_GRAMMARS, value, sizeof(SPHINX_LOCAL_GRAMMARS));
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "localhmm"))) {
+		ast_copy_string(SPHINX_LOCAL_HMM, value, sizeof(SPHINX_LOCAL_HMM));
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "localdict"))) {
+		ast_copy_string(SPHINX_LOCAL_DICT, value, sizeof(SPHINX_LOCAL_DICT));
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "localgrammardir"))) {
+		ast_copy_string(SPHINX_LOCAL_DIR, value, sizeof(SPHINX_LOCAL_DIR));
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "localworkers"))) {
+		sscanf(value, "%d", &SPHINX_LOCAL_WORKERS);
+		if (SPHINX_LOCAL_WORKERS < 1)
+			SPHINX_LOCAL_WORKERS = 1;
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "localqueue"))) {
+		sscanf(value, "%d", &SPHINX_LOCAL_QUEUE);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "capture"))) {
+		SPHINX_CAPTURE = ast_true(value);
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "capturedir"))) {
+		ast_copy_string(SPHINX_CAPTURE_DIR, value, sizeof(SPHINX_CAPTURE_DIR));
+	}
+	if ((value = ast_variable_retrieve(conf, "general", "capturequeue"))) {
+		sscanf(value, "%d", &SPHINX_CAPTURE_QUEUE);
+	}
+
+	sphinx_fe_init();
+	ast_cond_init(&admit_cond, NULL);
+	if (SPHINX_LEARN_ENDPOINT)
+		sphinx_endpoint_load();
+
+	if (SPHINX_CAPTURE && sphinx_capture_start() != SPHINX_SUCCESS) {
+		ast_log(LOG_ERROR, "Cannot start wire capture in %s\n", SPHINX_CAPTURE_DIR);
+		SPHINX_CAPTURE = 0;
+	}
+	if (SPHINX_SHADOW_RATE > 0 && !ast_strlen_zero(SPHINX_SHADOW_SERVER) &&
+		sphinx_shadow_start() != SPHINX_SUCCESS) {
+		ast_log(LOG_ERROR, "Cannot mirror traffic to canary %s\n", SPHINX_SHADOW_SERVER);
+		SPHINX_SHADOW_RATE = 0;
+	}
+	if (sphinx_local_start() != SPHINX_SUCCESS) {
+		ast_log(LOG_ERROR, "Cannot start local decoders, all grammars go to the server\n");
+		sphinx_local_stop();
+	}
+	if (SPHINX_NOTIFY && sphinx_notify_start() != SPHINX_SUCCESS) {
+		ast_log(LOG_ERROR, "Cannot start result notifier, results will be polled\n");
+		SPHINX_NOTIFY = 0;
+	}
+
+	ast_copy_string(backends[0].host, SPHINX_SERVER_ADDR, sizeof(backends[0].host));
+	backends[0].port = SPHINX_SERVER_PORT;
+	if (!ast_strlen_zero(SPHINX_SERVERS)) {
+		char list[sizeof(SPHINX_SERVERS)], *p = list, *name, *port;
+
+		ast_copy_string(list, SPHINX_SERVERS, sizeof(list));
+		nbackends = 0;
+		while ((name = strsep(&p, ",")) && nbackends < SPHINX_MAX_BACKENDS) {
+			name = ast_strip(name);
+			if (ast_strlen_zero(name))
+				continue;
+			backends[nbackends].port = SPHINX_SERVER_PORT;
+			if ((port = strchr(name, ':'))) {
+				*port++ = '\0';
+				sscanf(port, "%d", &backends[nbackends].port);
+			}
+			ast_copy_string(backends[nbackends].host, name, sizeof(backends[0].host));
+			nbackends++;
+		}
+		if (name != NULL)
+			ast_log(LOG_WARNING, "Only the first %d servers are used\n", SPHINX_MAX_BACKENDS);
+		if (nbackends == 0)
+			nbackends = 1;
+	}
+	sphinx_ring_build();
 
 	ast_log(LOG_NOTICE,
-			"Using Server: %s:%d Silence Time: %d Threshold: %d Noise Frames: %d\n",
-			SPHINX_SERVER_ADDR, SPHINX_SERVER_PORT, SPHINX_SILENCE_TIME,
-			SPHINX_SILENCE_THRESHOLD, SPHINX_NOISE_FRAMES);
+			"Using Server: %s:%d (of %d) Silence Time: %d Threshold: %d Noise Frames: %d Overload: %s/%dms\n",
+			backends[0].host, backends[0].port, nbackends, SPHINX_SILENCE_TIME,
+			SPHINX_SILENCE_THRESHOLD, SPHINX_NOISE_FRAMES,
+			overload_names[SPHINX_OVERLOAD_POLICY], SPHINX_OVERLOAD_WAIT);
 
 	if (ast_speech_register(&SPHINX_ENGINE_INFO)) {
 		ast_log(LOG_ERROR, "Failed to register.\n");
 		return AST_MODULE_LOAD_FAILURE;
 	}
 
+	ast_cli_register_multiple(sphinx_cli, ARRAY_LEN(sphinx_cli));
+	ast_manager_register2("SphinxEnServers", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING,
+						  manager_sphinx_servers, "List Sphinx-En server counters",
+						  "Description: Lists traffic, buffer and error counters for\n"
+						  "each Sphinx-En recognition server.\n"
+						  "Variables:\n"
+						  "  ActionID: <id>  Action ID for this transaction. Will be returned.\n");
+
 	return AST_MODULE_LOAD_SUCCESS;
 }
 
 /*! \brief Unload module */
 static int unload_module(void)
 {
+	ast_cli_unregister_multiple(sphinx_cli, ARRAY_LEN(sphinx_cli));
+	ast_manager_unregister("SphinxEnServers");
+	sphinx_notify_stop();
+	sphinx_capture_stop();
+	sphinx_shadow_stop();
+	sphinx_local_stop();
+	if (SPHINX_LEARN_ENDPOINT)
+		sphinx_endpoint_save();
+	sphinx_endpoint_free();
+	ast_cond_destroy(&admit_cond);
+
 	if (ast_speech_unregister(SPHINX_ENGINE_INFO.name)) {
 		ast_log(LOG_ERROR, "Failed to unregister.\n");
 		return -1;
@@ -172,12 +3958,28 @@ static int unload_module(void)
 /*! \brief Create instance of Sphinx engine */
 int sphinx_create(struct ast_speech *speech, int format)
 {
+	struct sphinx_state *ss;
+
 	/* ast_log(LOG_DEBUG, "sphinx_create called\n"); */
-	if (reinit_speech_data(speech) == SPHINX_SUCCESS)
-		if (sphinx_connect(speech, SPHINX_SERVER_ADDR, SPHINX_SERVER_PORT) ==
-			SPHINX_SUCCESS)
+	if (reinit_speech_data(speech) == SPHINX_SUCCESS) {
+		ss = (struct sphinx_state *) speech->data;
+		if (!(ss->admitted = sphinx_admit(ss->priority))) {
+			ast_log(LOG_WARNING, "Sphinx is at its limit of %d sessions, refusing another\n",
+					SPHINX_MAX_SESSIONS);
+			destroy_speech_data(speech);
+			return -1;
+		}
+		sphinx_shadow_pick(ss);
+		/* No grammar yet: the least loaded server, until sphinx_activate() knows better */
+		if (sphinx_connect_routed(speech, NULL) == SPHINX_SUCCESS)
 			return 0;
+		ast_log(LOG_WARNING, "No Sphinx server can be reached\n");
+		sphinx_shadow_close(ss);
+		sphinx_admit_release(ss);
+	}
 
+	/* The core does not call destroy for an engine that failed to create */
+	destroy_speech_data(speech);
 	ast_log(LOG_ERROR, "Can't create Sphinx server\n");
 	return -1;
 }
@@ -185,7 +3987,20 @@ int sphinx_create(struct ast_speech *speech, int format)
 /*! \brief Destroy instance of Sphinx engine */
 int sphinx_destroy(struct ast_speech *speech)
 {
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+
 	/* ast_log(LOG_DEBUG, "sphinx_destroy called\n"); */
+	/* Hung up mid-utterance: let the server free the decoder now, not when it sees the close */
+	if (ss != NULL && ss->inutterance && (ss->caps & SPHINX_CAP_CANCEL)) {
+		sphinx_notify_unregister(ss);
+		if (sphinx_cancel(speech) == SPHINX_SUCCESS)
+			sphinx_drain_writes(ss, 100);
+	}
+
+	if (ss != NULL) {
+		sphinx_shadow_close(ss);
+		sphinx_admit_release(ss);
+	}
 	if (sphinx_disconnect(speech) == SPHINX_SUCCESS)
 		if (destroy_speech_data(speech) == SPHINX_SUCCESS)
 			return SPHINX_SUCCESS;
@@ -210,11 +4025,47 @@ int sphinx_unload(struct ast_speech *speech, char *grammar_name)
 /*! \brief Chooses which grammar set to use on Sphinx server (i.e. which words to listen for */
 int sphinx_activate(struct ast_speech *speech, char *grammar_name)
 {
-	struct sphinx_request sr;
-	sr.rtype = REQTYPE_GRAMMAR;
-	sr.dlen = strlen(grammar_name) + 1;
-	sr.data = grammar_name;
-	if (sphinx_comm(&sr, speech, 1) != SPHINX_SUCCESS) {
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	int i;
+
+	if (ss == NULL)
+		return -1;
+
+	ast_copy_string(ss->grammar, grammar_name, sizeof(ss->grammar));
+	if (!(ss->caps & SPHINX_CAP_MULTIGRAMMAR))
+		ss->ngrammars = 0;
+	for (i = 0; i < ss->ngrammars; i++) {
+		if (!strcmp(ss->grammars[i], grammar_name))
+			break;
+	}
+	if (i == ss->ngrammars) {
+		if (ss->ngrammars == SPHINX_MAX_GRAMMARS) {
+			ast_log(LOG_WARNING, "Cannot activate %s, %d grammars are active already\n",
+					grammar_name, SPHINX_MAX_GRAMMARS);
+			return -1;
+		}
+		ast_copy_string(ss->grammars[ss->ngrammars++], grammar_name, sizeof(ss->grammars[0]));
+	}
+
+	/* The canary hears the grammar deciding the result, wherever it is decoded */
+	if (ss->shadow)
+		sphinx_shadow(ss, REQTYPE_GRAMMAR, 0, 0, ss->grammars[0], strlen(ss->grammars[0]) + 1);
+
+	/* One small grammar is decoded here; anything else is the server's */
+	ss->local = ss->ngrammars == 1 && sphinx_local_has(ss->grammars[0]);
+	if (ss->local) {
+		ast_speech_change_state(speech, AST_SPEECH_STATE_READY);
+		return 0;
+	}
+
+	/* Move to the server that has this grammar hot */
+	if (nbackends > 1 && sphinx_connect_routed(speech, ss->grammars[0]) != SPHINX_SUCCESS) {
+		ast_log(LOG_ERROR, "No Sphinx server can be reached for grammar %s\n", ss->grammars[0]);
+		ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+		return -1;
+	}
+
+	if (sphinx_send_grammars(speech) != SPHINX_SUCCESS) {
 		ast_log(LOG_ERROR, "Comms error changing grammar request\n");
 		ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
 		return -1;
@@ -224,10 +4075,27 @@ int sphinx_activate(struct ast_speech *speech, char *grammar_name)
 	return 0;
 }
 
+/*! \brief Send the active grammar set, NUL separated */
+int sphinx_send_grammars(struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct sphinx_request sr;
+	char buf[sizeof(ss->grammars)];
+	int i;
+
+	sr.rtype = REQTYPE_GRAMMAR;
+	sr.dlen = 0;
+	sr.data = buf;
+	sr.silent = 0;
+	for (i = 0; i < ss->ngrammars; i++)
+		sr.dlen += sprintf(buf + sr.dlen, "%s", ss->grammars[i]) + 1;
+	return sphinx_comm(&sr, speech, 1);
+}
+
 /*! \brief 
- * sphinx_deactivate does nothing to the grammar but based on the examples
- * I've seen it's a good place to signal to the engine this is its
- * last chance to provide results.
+ * sphinx_deactivate is, based on the examples I've seen, a good place to
+ * signal to the engine this is its last chance to provide results.  With
+ * several grammars active it also takes this one out of the set.
  */
 int sphinx_deactivate(struct ast_speech *speech, char *grammar_name)
 {
@@ -245,81 +4113,297 @@ int sphinx_deactivate(struct ast_speech *speech, char *grammar_name)
 		}
 	}
 
+	if (ss->caps & SPHINX_CAP_MULTIGRAMMAR) {
+		int i;
+
+		for (i = 0; i < ss->ngrammars; i++) {
+			if (!strcmp(ss->grammars[i], grammar_name))
+				break;
+		}
+		/* The last one stays; a server with no grammar cannot decode anything */
+		if (i < ss->ngrammars && ss->ngrammars > 1) {
+			memmove(ss->grammars[i], ss->grammars[i + 1],
+					(ss->ngrammars - i - 1) * sizeof(ss->grammars[0]));
+			ss->ngrammars--;
+			if (sphinx_send_grammars(speech) != SPHINX_SUCCESS) {
+				ast_log(LOG_ERROR, "Comms error - setting NOT_READY\n");
+				ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+				return -1;
+			}
+		}
+	}
+
 	return 0;
 }
 
 /*! \brief non-blocking data read from socket */
 int sphinx_sread(struct sphinx_state *ss, struct ast_speech *speech)
 {
-	int rbytes = 0;
+	int rbytes;
+	int hlen = ss->proto ? SPHINX_RESPHDR_V1 : sizeof(int32_t);
 
-	if (ss->preads == 0 && ss->prbytes == 0) {
-		return SPHINX_SUCCESS;
-	}
+	/* Final results are what the caller waits on, do not sit on their ACKs */
+	if (ss->final && ss->sock.quickack && ss->preads)
+		setsockopt(ss->s, IPPROTO_TCP, TCP_QUICKACK, &(int){1}, sizeof(int));
 
-	while (ss->preads && !ss->prbytes) {
-		int32_t rsize = 0;
-		if ((rbytes = read(ss->s, &rsize, sizeof(int32_t))) == -1) {
-			if (errno != EWOULDBLOCK) {
-				return make_error(speech, strerror(errno));
-			} else {
+	while (ss->preads || ss->rhdrused == hlen) {
+		/* Headers may arrive in pieces too, collect them in rhdr */
+		if (ss->rhdrused < hlen) {
+			rbytes = sphinx_io->read(ss, ss->rhdr + ss->rhdrused, hlen - ss->rhdrused);
+			SPHINX_STAT(ss, syscalls, 1);
+			if (rbytes == -1) {
+				if (errno != EWOULDBLOCK) {
+					SPHINX_STAT(ss, errors, 1);
+					sphinx_breaker_report(ss->backend, 0);
+					return make_error(speech, strerror(errno));
+				}
 				break;
+			} else if (rbytes == 0) {
+				return make_error(speech, "Sphinx server closed the connection\n");
+			}
+			ss->rhdrused += rbytes;
+			SPHINX_STAT(ss, bytes_recv, rbytes);
+			if (ss->rhdrused < hlen)
+				continue;
+
+			if (ss->proto) {
+				ss->prbytes = sphinx_get32(ss->rhdr);
+				ss->rkind = sphinx_get32(ss->rhdr + 4);
+				ss->rseq = sphinx_get32(ss->rhdr + 8);
+			} else {
+				ss->prbytes = *(int32_t *) ss->rhdr;
+				ss->rkind = RESPTYPE_RESULT;
+				ss->rseq = ss->utterance;
 			}
-		} else if (rbytes == sizeof(int32_t)) {
 			ss->rbufused = 0;
-			ss->prbytes = rsize;
 			ss->preads--;
-		}
-	}
 
-	if (ss->prbytes + ss->rbufused > SPHINX_BUFSIZE)
-		return make_error(speech, "BUFFER OVERFLOW IN SPHINX READ BUFFER\n");
+			if (ss->prbytes < 0 || ss->prbytes > SPHINX_BUFSIZE) {
+				SPHINX_STAT(ss, overflows, 1);
+				return make_error(speech, "BUFFER OVERFLOW IN SPHINX READ BUFFER\n");
+			}
+		}
 
-	rbytes = 0;
-	while (ss->prbytes != 0 &&
-		   (rbytes = read(ss->s, ss->rbuf + ss->rbufused, ss->prbytes)) != -1) {
-		if (rbytes != 0) {
+		while (ss->prbytes) {
+			rbytes = sphinx_io->read(ss, ss->rbuf + ss->rbufused, ss->prbytes);
+			SPHINX_STAT(ss, syscalls, 1);
+			if (rbytes == -1) {
+				if (errno != EWOULDBLOCK) {
+					SPHINX_STAT(ss, errors, 1);
+					sphinx_breaker_report(ss->backend, 0);
+					return make_error(speech, strerror(errno));
+				}
+				return SPHINX_SUCCESS;
+			} else if (rbytes == 0) {
+				return make_error(speech, "Sphinx server closed the connection\n");
+			}
 			ss->prbytes -= rbytes;
 			ss->rbufused += rbytes;
+			SPHINX_STAT(ss, bytes_recv, rbytes);
 		}
+		SPHINX_STAT_HWM(ss, rbufused_hwm, ss->rbufused);
+		SPHINX_STAT(ss, responses, 1);
+
+		/* We finished reading a response. */
+		ss->rhdrused = 0;
+		if (ss->capture)
+			sphinx_capture(ss, SPHINX_CAPTURE_RESPONSE, ss->rkind, ss->rseq, ss->rbuf, ss->rbufused);
+		if (sphinx_handle_response(ss, speech) != SPHINX_SUCCESS)
+			return SPHINX_ERROR;
+		hlen = ss->proto ? SPHINX_RESPHDR_V1 : sizeof(int32_t);
 	}
 
-	if (rbytes == -1) {
-		if (errno == EWOULDBLOCK) {
-			rbytes = 0;
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Act on a complete response sitting in rbuf */
+int sphinx_handle_response(struct sphinx_state *ss, struct ast_speech *speech)
+{
+	int32_t new_score = 0;
+	const char *text, *grammar;
+	int tlen;
+
+	if (ss->handshaking) {
+		if (ss->rbufused >= 3 * sizeof(uint32_t) && sphinx_get32(ss->rbuf) == SPHINX_PROTO_MAGIC) {
+			ss->proto = MIN(sphinx_get32(ss->rbuf + 4), SPHINX_PROTO_VERSION);
+			ss->caps = sphinx_get32(ss->rbuf + 8) & SPHINX_WANT_CAPS;
+			/* Datagram audio needs to know where to, and how to name us */
+			if ((ss->caps & SPHINX_CAP_DATAGRAM) && ss->rbufused >= 5 * sizeof(uint32_t)) {
+				ss->dgram_port = sphinx_get32(ss->rbuf + 12);
+				ss->dgram_token = sphinx_get32(ss->rbuf + 16);
+			} else {
+				ss->caps &= ~SPHINX_CAP_DATAGRAM;
+			}
+			ast_log(LOG_DEBUG, "Negotiated protocol version %d, capabilities 0x%x\n",
+					ss->proto, ss->caps);
 		} else {
-			return make_error(speech, strerror(errno));
+			ast_log(LOG_NOTICE, "Sphinx server did not answer the handshake, using legacy protocol\n");
 		}
+		return SPHINX_SUCCESS;
+	}
+
+	if (ss->discard || (ss->proto && ss->rseq != ss->utterance)) {
+		/* Belongs to a cancelled utterance */
+		if (ss->discard)
+			ss->discard--;
+		return SPHINX_SUCCESS;
 	}
 
+	if (ss->rkind == RESPTYPE_ACK)
+		return SPHINX_SUCCESS;
 
-	if (rbytes && !ss->prbytes)	/* We finished reading some results. */
-	{
-    int32_t new_score = 0;
-		if (speech->results == NULL)
-			speech->results = ast_calloc(sizeof(struct ast_speech_result), 1);
-		if (speech->results == NULL)
+	if (ss->rkind == RESPTYPE_PARTIAL)
+		return sphinx_handle_partial(ss, speech);
+
+	if (ss->rkind != RESPTYPE_RESULT) {
+		ast_log(LOG_WARNING, "Ignoring unexpected response type %u\n", ss->rkind);
+		return SPHINX_SUCCESS;
+	}
+
+	if (ss->rbufused < sizeof(int32_t))
+		return make_error(speech, "Short result from Sphinx server\n");
+
+	text = ss->rbuf + sizeof(int32_t);
+	tlen = ss->rbufused - sizeof(int32_t);
+	if (sphinx_result_grammar(ss, &text, &tlen, &grammar) != SPHINX_SUCCESS)
+		return make_error(speech, "Result from Sphinx server names no grammar\n");
+
+	if (speech->results == NULL)
+		speech->results = ast_calloc(sizeof(struct ast_speech_result), 1);
+	if (speech->results == NULL)
+		return make_error(speech, "Cannot allocate results\n");
+
+	new_score = ss->proto ? (int32_t) sphinx_get32(ss->rbuf) : *(int32_t *) ss->rbuf;
+	if (ss->partialshown || new_score >= speech->results->score) {
+		ss->partialshown = 0;
+		if (sphinx_set_result(speech, new_score, grammar, text, tlen) != SPHINX_SUCCESS)
 			return make_error(speech, "Cannot allocate results\n");
+		ast_log(LOG_NOTICE, "Score: %d Grammar: %s Result: '%s'\n", speech->results->score,
+				S_OR(speech->results->grammar, "?"), speech->results->text);
+	} else {
+		ast_log(LOG_NOTICE, "New result with lower score; ignoring.\n");
+	}
+	speech->flags |= AST_SPEECH_HAVE_RESULTS;
+	sphinx_breaker_report(ss->backend, 1);
 
-		new_score = *(int32_t *) ss->rbuf;
-		if (new_score >= speech->results->score) {
-			speech->results->score = new_score;
-			if (speech->results->text != NULL) {
-				free(speech->results->text);
-				speech->results->text = NULL;
-			}
-			speech->results->text =
-				ast_strndup(ss->rbuf + sizeof(int32_t), ss->rbufused - sizeof(int32_t));
-			ast_log(LOG_NOTICE, "Score: %d Result: '%s'\n", speech->results->score,
-					speech->results->text);
-		} else {
-			ast_log(LOG_NOTICE, "New result with lower score; ignoring.\n");
-		}
-		speech->flags |= AST_SPEECH_HAVE_RESULTS;
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief
+ * A partial hypothesis stands in as the result until the final one arrives,
+ * and restarts the stability clock whenever its text changes.
+ */
+int sphinx_handle_partial(struct sphinx_state *ss, struct ast_speech *speech)
+{
+	const char *text = ss->rbuf + 2 * sizeof(uint32_t);
+	int tlen = ss->rbufused - 2 * sizeof(uint32_t);
+	const char *grammar;
+
+	if (ss->rbufused < 2 * sizeof(uint32_t))
+		return make_error(speech, "Short partial result from Sphinx server\n");
+	if (sphinx_result_grammar(ss, &text, &tlen, &grammar) != SPHINX_SUCCESS)
+		return make_error(speech, "Partial result from Sphinx server names no grammar\n");
+
+	ss->partialend = sphinx_get32(ss->rbuf + 4) & SPHINX_PARTIAL_ENDSTATE;
+	if (ss->partial == NULL || strlen(ss->partial) != tlen || strncmp(ss->partial, text, tlen)) {
+		free(ss->partial);
+		ss->partial = ast_strndup(text, tlen);
+		ss->stablefor = 0;
 	}
 
+	if (sphinx_set_result(speech, (int32_t) sphinx_get32(ss->rbuf), grammar, text, tlen) != SPHINX_SUCCESS)
+		return make_error(speech, "Cannot allocate results\n");
+	ss->partialshown = 1;
+	speech->flags |= AST_SPEECH_HAVE_RESULTS;
+	ast_log(LOG_DEBUG, "Partial: '%s'%s\n", S_OR(ss->partial, ""),
+			ss->partialend ? " (end state)" : "");
+
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief
+ * Results name their grammar when several can be active; otherwise the text
+ * came from the one grammar the server has, the last activated.
+ */
+int sphinx_result_grammar(struct sphinx_state *ss, const char **text, int *tlen,
+						  const char **grammar)
+{
+	const char *end;
+
+	if (!(ss->caps & SPHINX_CAP_MULTIGRAMMAR)) {
+		*grammar = ss->grammar;
+		return SPHINX_SUCCESS;
+	}
+	if ((end = memchr(*text, '\0', *tlen)) == NULL)
+		return SPHINX_ERROR;
+	*grammar = *text;
+	*tlen -= end + 1 - *text;
+	*text = end + 1;
 	return SPHINX_SUCCESS;
+}
+
+/*! \brief Replace speech->results with text from grammar */
+int sphinx_set_result(struct ast_speech *speech, int score, const char *grammar,
+					  const char *text, int tlen)
+{
+	struct ast_speech_result *res = speech->results;
+
+	if (res == NULL && (res = speech->results = ast_calloc(sizeof(*res), 1)) == NULL)
+		return SPHINX_ERROR;
+	free(res->text);
+	res->text = ast_strndup(text, tlen);
+	if (res->grammar == NULL || strcmp(res->grammar, S_OR(grammar, ""))) {
+		free(res->grammar);
+		res->grammar = ast_strlen_zero(grammar) ? NULL : ast_strdup(grammar);
+	}
+	res->score = score;
+	return res->text ? SPHINX_SUCCESS : SPHINX_ERROR;
+}
+
+/*! \brief Encode a request header for the negotiated framing, returns its length */
+int sphinx_reqhdr(struct sphinx_state *ss, struct sphinx_request *sr, char *hdr)
+{
+	if (ss->proto) {
+		sphinx_put32(hdr, sr->dlen);
+		sphinx_put32(hdr + 4, sr->rtype);
+		sphinx_put32(hdr + 8, ss->utterance);
+		return SPHINX_REQHDR_V1;
+	}
+
+	/* Legacy: native int length, then the enum as the compiler lays it out */
+	memcpy(hdr, &sr->dlen, sizeof(sr->dlen));
+	memcpy(hdr + sizeof(sr->dlen), &sr->rtype, sizeof(sr->rtype));
+	return sizeof(sr->dlen) + sizeof(sr->rtype);
+}
+
+/*! \brief
+ * Sends REQTYPE_HELLO and waits for the answer.  A legacy server answers
+ * with an ordinary result, which leaves us on the legacy protocol but in sync.
+ */
+int sphinx_handshake(struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct sphinx_request sr;
+	char hello[4 * sizeof(uint32_t)];
+	int res;
+
+	sphinx_put32(hello, SPHINX_PROTO_MAGIC);
+	sphinx_put32(hello + 4, SPHINX_PROTO_VERSION);
+	sphinx_put32(hello + 8, SPHINX_HOST_ORDER);
+	sphinx_put32(hello + 12, SPHINX_WANT_CAPS);
+
+	sr.rtype = REQTYPE_HELLO;
+	sr.dlen = sizeof(hello);
+	sr.data = hello;
+	sr.silent = 0;
 
+	ss->proto = 0;
+	ss->caps = 0;
+	ss->handshaking = 1;
+	res = sphinx_comm(&sr, speech, 1);
+	ss->handshaking = 0;
+
+	return res;
 }
 
 /*! \brief Log an error, set error state. */
@@ -333,28 +4417,265 @@ int make_error(struct ast_speech *speech, char *errmsg)
 /*! \brief non-blocking socket write */
 int sphinx_swrite(struct sphinx_state *ss, void *indata, int len)
 {
-	char *data = (char *) indata;
+	char *data = (char *) indata;
+
+	if (ss->pwbytes + len > SPHINX_BUFSIZE)	// Too much data!
+	{
+		SPHINX_STAT(ss, overflows, 1);
+		ast_log(LOG_ERROR, "Output buffer overflow.\n");
+		return SPHINX_ERROR;
+	}
+
+	memcpy(ss->sbuf + ss->pwbytes, data, len);
+	ss->pwbytes += len;
+	ss->wqueued += len;
+	SPHINX_STAT_HWM(ss, pwbytes_hwm, ss->pwbytes);
+
+	if (ss->pwbytes) /* Something to send */
+	{
+		int bcount = sphinx_io->send(ss, ss->sbuf, ss->pwbytes, ss->more ? MSG_MORE : 0);
+		SPHINX_STAT(ss, syscalls, 1);
+		if (bcount == -1 && (errno != EWOULDBLOCK)) {
+			SPHINX_STAT(ss, errors, 1);
+			sphinx_breaker_report(ss->backend, 0);
+			ast_log(LOG_ERROR, "Error writing to Sphinx server: %s\n", strerror(errno));
+			return SPHINX_ERROR;
+		}
+		if (bcount == -1)
+			bcount = 0;
+		memmove(ss->sbuf, ss->sbuf + bcount, ss->pwbytes - bcount);
+		ss->pwbytes -= bcount;
+		ss->wsent += bcount;
+		SPHINX_STAT(ss, bytes_sent, bcount);
+		if (ss->pwbytes)
+			SPHINX_STAT(ss, partial_writes, 1);
+
+		/* Frames that made it (even partly) to the wire can no longer be shed */
+		while (ss->nqframes && ss->qframes[0].start < ss->wsent) {
+			ss->nqframes--;
+			memmove(&ss->qframes[0], &ss->qframes[1], ss->nqframes * sizeof(ss->qframes[0]));
+		}
+	}
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Open the session's datagram socket to the port the server named */
+static int sphinx_dgram_open(struct sphinx_state *ss, const struct sockaddr_in *server)
+{
+	struct sockaddr_in sin = *server;
+
+	if ((ss->dgram = socket(AF_INET, SOCK_DGRAM, 0)) <= 0) {
+		ss->dgram = 0;
+		return SPHINX_ERROR;
+	}
+	sin.sin_port = htons(ss->dgram_port);
+	if (connect(ss->dgram, (struct sockaddr *) &sin, sizeof(sin)) ||
+		sphinx_set_blocking(ss->dgram, 0) != SPHINX_SUCCESS) {
+		close(ss->dgram);
+		ss->dgram = 0;
+		return SPHINX_ERROR;
+	}
+	if (ss->sock.sndbuf)
+		setsockopt(ss->dgram, SOL_SOCKET, SO_SNDBUF, &ss->sock.sndbuf, sizeof(ss->sock.sndbuf));
+	return SPHINX_SUCCESS;
+}
+
+static void sphinx_dgram_close(struct sphinx_state *ss)
+{
+	if (ss->dgram) {
+		close(ss->dgram);
+		ss->dgram = 0;
+	}
+	ast_free(ss->dgram_held);
+	ss->dgram_held = NULL;
+}
+
+/*! \brief
+ * Put one datagram on the wire.  One the kernel has no room for is lost like
+ * one the network drops; any other error puts the session back on the stream.
+ */
+static int sphinx_dgram_write(struct sphinx_state *ss, const char *pkt, int len)
+{
+	struct sphinx_faults f = fault_cfg;
+
+	if (f.loss && ast_random() % 100 < f.loss) {
+		ast_atomic_fetchadd_int(&fault_stats.lost, 1);
+		return SPHINX_SUCCESS;
+	}
+	if (f.reorder && ss->dgram_held == NULL && ast_random() % 100 < f.reorder &&
+		(ss->dgram_held = ast_malloc(len)) != NULL) {
+		memcpy(ss->dgram_held, pkt, len);
+		ss->dgram_heldlen = len;
+		ast_atomic_fetchadd_int(&fault_stats.reordered, 1);
+		return SPHINX_SUCCESS;
+	}
+
+	for (;;) {
+		SPHINX_STAT(ss, syscalls, 1);
+		if (send(ss->dgram, pkt, len, MSG_DONTWAIT) == len) {
+			ast_atomic_fetchadd_int(&dgram_stats.sent, 1);
+			SPHINX_STAT(ss, bytes_sent, len);
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+			ast_atomic_fetchadd_int(&dgram_stats.dropped, 1);
+		} else {
+			ast_log(LOG_WARNING, "Cannot send audio datagram, back to the stream: %s\n",
+					strerror(errno));
+			ast_atomic_fetchadd_int(&dgram_stats.fallbacks, 1);
+			sphinx_dgram_close(ss);
+			ss->caps &= ~SPHINX_CAP_DATAGRAM;
+			return SPHINX_ERROR;
+		}
+		if (ss->dgram_held == NULL || pkt == ss->dgram_held)
+			break;
+		/* The one held back follows */
+		pkt = ss->dgram_held;
+		len = ss->dgram_heldlen;
+	}
+	ast_free(ss->dgram_held);
+	ss->dgram_held = NULL;
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Send audio or cepstra as datagrams of at most SPHINX_DGRAM_MAX bytes each */
+static int sphinx_dgram_send(struct sphinx_state *ss, const char *data, int len)
+{
+	char pkt[SPHINX_DGRAM_HDR + SPHINX_DGRAM_MAX];
+	int n;
+
+	if (ss->dgram_utt != ss->utterance) {
+		ss->dgram_utt = ss->utterance;
+		ss->dgram_frames = 0;
+		ss->dgram_ms = 0;
+	}
+	for (; len > 0; data += n, len -= n) {
+		n = MIN(len, SPHINX_DGRAM_MAX);
+		sphinx_put32(pkt, ss->dgram_token);
+		sphinx_put32(pkt + 4, ss->utterance);
+		sphinx_put32(pkt + 8, ss->dgram_frames);
+		sphinx_put32(pkt + 12, ss->dgram_ms);
+		memcpy(pkt + SPHINX_DGRAM_HDR, data, n);
+		if (sphinx_dgram_write(ss, pkt, SPHINX_DGRAM_HDR + n) != SPHINX_SUCCESS)
+			return SPHINX_ERROR;
+		ss->dgram_frames++;
+		if (ss->caps & SPHINX_CAP_FEATURES)
+			ss->dgram_ms += n / (SPHINX_FE_NCEP * sizeof(float)) * 1000 * SPHINX_FE_SHIFT / SPHINX_FE_RATE;
+		else
+			ss->dgram_ms += n / 16;
+	}
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief
+ * Drops the oldest silent DATA request that is still entirely in sbuf.  The
+ * server never sees it, so we stop expecting its response too.
+ */
+int sphinx_shed_silence(struct sphinx_state *ss)
+{
+	int i, off, len;
+
+	for (i = 0; i < ss->nqframes; i++) {
+		if (ss->qframes[i].start < ss->wsent)
+			continue;
+
+		off = ss->qframes[i].start - ss->wsent;
+		len = ss->qframes[i].len;
+		memmove(ss->sbuf + off, ss->sbuf + off + len, ss->pwbytes - off - len);
+		ss->pwbytes -= len;
+		ss->wqueued -= len;
+
+		ss->nqframes--;
+		memmove(&ss->qframes[i], &ss->qframes[i + 1],
+				(ss->nqframes - i) * sizeof(ss->qframes[0]));
+		for (; i < ss->nqframes; i++)
+			ss->qframes[i].start -= len;
+
+		ss->preads--;
+		ast_atomic_fetchadd_int(&overload_stats.dropped, 1);
+		return SPHINX_SUCCESS;
+	}
+	return SPHINX_ERROR;
+}
+
+/*! \brief
+ * Called before a request is queued.  If sbuf cannot hold it, the server is not
+ * keeping up; apply the configured overload policy instead of failing the call
+ * outright.  Returns SPHINX_SHED if the request should silently be skipped.
+ */
+int sphinx_make_room(struct sphinx_request *sr, struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	int need = SPHINX_REQHDR_LEN(ss) + sr->dlen;
+	int wait = SPHINX_OVERLOAD_WAIT;
+	struct timeval deadline;
 
-	if (ss->pwbytes + len > SPHINX_BUFSIZE)	// Too much data!
-	{
-		ast_log(LOG_ERROR, "Output buffer overflow.\n");
-		return SPHINX_ERROR;
+	if (ss->pwbytes + need <= SPHINX_BUFSIZE)
+		return SPHINX_SUCCESS;
+
+	/* Unpaced bulk audio outruns any server by design, that is no overload */
+	if (ss->bulk)
+		wait = 5000;
+	else switch (SPHINX_OVERLOAD_POLICY) {
+	case SPHINX_OVERLOAD_DROP:
+		while (ss->pwbytes + need > SPHINX_BUFSIZE && sphinx_shed_silence(ss) == SPHINX_SUCCESS);
+		if (ss->pwbytes + need <= SPHINX_BUFSIZE)
+			return SPHINX_SUCCESS;
+		if (sr->rtype == REQTYPE_DATA && sr->dlen && sr->silent) {
+			ast_atomic_fetchadd_int(&overload_stats.dropped, 1);
+			return SPHINX_SHED;
+		}
+		break;
+	case SPHINX_OVERLOAD_FINISH:
+		if (sr->rtype == REQTYPE_DATA && sr->dlen) {
+			ast_log(LOG_WARNING, "Sphinx server falling behind, ending utterance early\n");
+			ast_atomic_fetchadd_int(&overload_stats.finished, 1);
+			sr->dlen = 0;
+			need = SPHINX_REQHDR_LEN(ss);
+		}
+		break;
+	case SPHINX_OVERLOAD_FAIL:
+		wait = 0;
+		break;
 	}
 
-	memcpy(ss->sbuf + ss->pwbytes, data, len);
-	ss->pwbytes += len;
+	/* Whatever could not be shed, wait for the server to drain. */
+	if (ss->pwbytes + need > SPHINX_BUFSIZE && wait > 0) {
+		if (!ss->bulk)
+			ast_atomic_fetchadd_int(&overload_stats.blocked, 1);
+		deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(wait, 1000));
 
-	if (ss->pwbytes) /* Something to send */
-	{
-		int bcount = write(ss->s, ss->sbuf, ss->pwbytes);
-		if (bcount == -1 && (errno != EWOULDBLOCK)) {
-			ast_log(LOG_ERROR, "Error writing to Sphinx server: %s\n", strerror(errno));
-			return SPHINX_ERROR;
+		while (ss->pwbytes + need > SPHINX_BUFSIZE) {
+			fd_set rsel, wsel;
+			struct timeval tv;
+			int left = ast_tvdiff_ms(deadline, ast_tvnow());
+
+			if (left <= 0) {
+				ast_atomic_fetchadd_int(&overload_stats.timeouts, 1);
+				break;
+			}
+
+			FD_ZERO(&rsel);
+			FD_ZERO(&wsel);
+			FD_SET(ss->s, &wsel);
+			/* Keep reading too, or a server blocked on its own writes never drains us */
+			if (ss->prbytes || ss->preads)
+				FD_SET(ss->s, &rsel);
+			tv.tv_sec = left / 1000;
+			tv.tv_usec = (left % 1000) * 1000;
+
+			SPHINX_STAT(ss, syscalls, 1);
+			if (select(ss->s + 1, &rsel, &wsel, NULL, &tv) == -1 && errno != EINTR)
+				return make_error(speech, "Select returned error.\n");
+			if (FD_ISSET(ss->s, &wsel) && sphinx_swrite(ss, NULL, 0) != SPHINX_SUCCESS)
+				return make_error(speech, "Error flushing write buffer.\n");
+			if (FD_ISSET(ss->s, &rsel) && sphinx_sread(ss, speech) != SPHINX_SUCCESS)
+				return SPHINX_ERROR;
 		}
-		if (bcount == -1)
-			bcount = 0;
-		memmove(ss->sbuf, ss->sbuf + bcount, ss->pwbytes - bcount);
-		ss->pwbytes -= bcount;
+	}
+
+	if (ss->pwbytes + need > SPHINX_BUFSIZE) {
+		SPHINX_STAT(ss, overflows, 1);
+		ast_atomic_fetchadd_int(&overload_stats.failed, 1);
+		return make_error(speech, "Output buffer overflow, Sphinx server is not keeping up.\n");
 	}
 	return SPHINX_SUCCESS;
 }
@@ -372,6 +4693,10 @@ int sphinx_comm(struct sphinx_request *sr, struct ast_speech *speech, int catchu
 	if (speech == NULL)
 		return make_error(speech, "No data\n");
 	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	long long start;
+	int room;
+	char hdr[SPHINX_REQHDR_V1];
+	char frames[sizeof(uint32_t)];
 
 	if (ss == NULL)
 		return make_error(speech, "No state\n");
@@ -380,29 +4705,76 @@ int sphinx_comm(struct sphinx_request *sr, struct ast_speech *speech, int catchu
 	if (sr == NULL)
 		return make_error(speech, "No request\n");
 
-	if ((sr->rtype & (REQTYPE_FINISH | REQTYPE_DATA)) &&
+	if (sr->rtype == REQTYPE_DATA && speech->state != AST_SPEECH_STATE_DONE && !ss->final) {
+		/* Audio by datagram: a lost one costs the recognizer that frame, not the ones behind it */
+		if (sr->dlen && ss->dgram && !ss->bulk &&
+			sphinx_dgram_send(ss, sr->data, sr->dlen) == SPHINX_SUCCESS) {
+			if (ss->capture)
+				sphinx_capture(ss, SPHINX_CAPTURE_REQUEST, sr->rtype, ss->utterance, sr->data, sr->dlen);
+			SPHINX_STAT(ss, frames, 1);
+			ss->inutterance = 1;
+			return sphinx_sread(ss, speech);
+		}
+		/* Tell the server how many to wait for */
+		if (!sr->dlen && ss->dgram_utt == ss->utterance && ss->dgram_frames) {
+			sphinx_put32(frames, ss->dgram_frames);
+			sr->rtype = REQTYPE_FINISH;
+			sr->data = frames;
+			sr->dlen = sizeof(frames);
+		}
+	}
+
+	if ((sr->rtype == REQTYPE_FINISH || sr->rtype == REQTYPE_DATA) &&
 		(speech->state == AST_SPEECH_STATE_DONE || ss->final)) {
 		sr->dlen = 0;
-	} else {
-		/* Write request type, data length */
-		if (sphinx_swrite(ss, &sr->dlen, sizeof(sr->dlen)) != SPHINX_SUCCESS)
-			return make_error(speech, "Socket write error sending dlen\n");
+	} else if ((room = sphinx_make_room(sr, speech)) == SPHINX_ERROR) {
+		return SPHINX_ERROR;
+	} else if (room == SPHINX_SUCCESS) {
+		start = ss->wqueued;
+
+		/* Keep a lone header from going out as its own segment */
+		if (sr->dlen && ss->sock.cork == SPHINX_CORK_CORK)
+			setsockopt(ss->s, IPPROTO_TCP, TCP_CORK, &(int){1}, sizeof(int));
+		ss->more = sr->dlen && ss->sock.cork == SPHINX_CORK_MSGMORE;
 
-		if (sphinx_swrite(ss, &sr->rtype, sizeof(sr->rtype)) != SPHINX_SUCCESS)
-			return make_error(speech, "Socket write error sending rtype\n");
+		/* Write data length, request type (and sequence) in one go */
+		if (sphinx_swrite(ss, hdr, sphinx_reqhdr(ss, sr, hdr)) != SPHINX_SUCCESS) {
+			ss->more = 0;
+			return make_error(speech, "Socket write error sending header\n");
+		}
+		ss->more = 0;
 
 		/* Write actual data, if any */
 		if (sr->dlen) {
 			if (sphinx_swrite(ss, sr->data, sr->dlen) != SPHINX_SUCCESS)
 				return make_error(speech, "Socket write error sending data\n");
 		}
+		if (sr->dlen && ss->sock.cork == SPHINX_CORK_CORK)
+			setsockopt(ss->s, IPPROTO_TCP, TCP_CORK, &(int){0}, sizeof(int));
+
+		if (ss->capture)
+			sphinx_capture(ss, SPHINX_CAPTURE_REQUEST, sr->rtype, ss->utterance, sr->data, sr->dlen);
+		SPHINX_STAT(ss, requests, 1);
+		if (sr->rtype == REQTYPE_DATA && sr->dlen)
+			SPHINX_STAT(ss, frames, 1);
+
+		/* Remember silent frames still sitting in sbuf, we may shed them later */
+		if (sr->rtype == REQTYPE_DATA && sr->dlen && sr->silent &&
+			start >= ss->wsent && ss->nqframes < SPHINX_MAXQFRAMES) {
+			ss->qframes[ss->nqframes].start = start;
+			ss->qframes[ss->nqframes].len = ss->wqueued - start;
+			ss->nqframes++;
+		}
 
 		ss->preads++;			/* Increment count of pending responses to expect */
+		if (sr->rtype == REQTYPE_DATA || sr->rtype == REQTYPE_FINISH)
+			ss->inutterance = 1;
 
     /* If we sent nothing, this is also a signal to finish */
 		if ((sr->rtype == REQTYPE_DATA && sr->dlen == 0) || sr->rtype == REQTYPE_FINISH)
 		{
-			ast_speech_change_state(speech, AST_SPEECH_STATE_DONE);
+			/* With a notifier, DONE waits until the results are actually in */
+			ast_speech_change_state(speech, ss->efd ? AST_SPEECH_STATE_WAIT : AST_SPEECH_STATE_DONE);
 			ss->final = 1;
 		}
 
@@ -415,14 +4787,21 @@ int sphinx_comm(struct sphinx_request *sr, struct ast_speech *speech, int catchu
 		return SPHINX_ERROR;
 
 	if (speech->state == AST_SPEECH_STATE_DONE || ss->final || catchup) {
-		while (ss->preads || ss->prbytes || ss->pwbytes) {
+		/*
+		 * Once final, a notifier session only needs its writes flushed here,
+		 * until its results are published: requests after that (a new grammar
+		 * activation, say) are nobody else's to read.
+		 */
+		int async = ss->efd && ss->final && !ss->published;
+
+		while (ss->pwbytes || (!async && (ss->preads || ss->prbytes))) {
 			/* ast_log(LOG_NOTICE, "Flushing buffers, Responses Pending: %d, Bytes in current response: %d, Bytes to write: %d\n",
 			 *       ss->preads, ss->prbytes, ss->pwbytes);
        */
 
 			fd_set rsel, wsel;
 			struct timeval tv;
-			int selret;
+			int selret, wait;
 
 			FD_ZERO(&rsel);
 			FD_ZERO(&wsel);
@@ -431,15 +4810,22 @@ int sphinx_comm(struct sphinx_request *sr, struct ast_speech *speech, int catchu
 			if (ss->prbytes || ss->preads)
 				FD_SET(ss->s, &rsel);
 
-			/* 5 seconds timeout is extreme. */
-			tv.tv_sec = 5;
-			tv.tv_usec = 0;
+			/* 5 seconds timeout is extreme; past a deadline only deadlinewait is left */
+			wait = ss->deadlined && ss->final ? MAX(sphinx_result_wait(ss, ss->deadline_tv), 0) : 5000;
+			tv.tv_sec = wait / 1000;
+			tv.tv_usec = (wait % 1000) * 1000;
 
 			selret = select(ss->s + 1, &rsel, &wsel, NULL, &tv);
+			SPHINX_STAT(ss, syscalls, 1);
 
 			if (selret == -1)
 				return make_error(speech, "Select returned error.\n");
-			else if (selret == 0) {
+			else if (selret == 0 && ss->deadlined && ss->final) {
+				sphinx_deadline_expire(speech);
+				return SPHINX_SUCCESS;
+			} else if (selret == 0) {
+				SPHINX_STAT(ss, timeouts, 1);
+				sphinx_breaker_report(ss->backend, 0);
 				return make_error(speech,
 								  "Reached 5-second timeout on socket flush, WTF.\n");
 			}
@@ -454,6 +4840,12 @@ int sphinx_comm(struct sphinx_request *sr, struct ast_speech *speech, int catchu
 					return make_error(speech, "Error flushing read buffer.\n");
 			}
 		}
+
+		if (ss->final && !ss->published) {
+			if (ss->preads || ss->prbytes)
+				return sphinx_notify_register(speech);
+			sphinx_publish_result(speech);
+		}
 	}
 
 	return SPHINX_SUCCESS;
@@ -465,8 +4857,6 @@ int sphinx_write(struct ast_speech *speech, void *data, int len)
 	struct ast_frame f;
   int totalsil;
 	int silence;
-	struct sphinx_request sr;
-  int finish;
 
 	if (speech->data == NULL) {
 		ast_log(LOG_ERROR, "Socket data does not exist.\n");
@@ -503,28 +4893,58 @@ int sphinx_write(struct ast_speech *speech, void *data, int len)
 
 	if (!ss->heardspeech && !silence) {
 		ss->noiseframes++;
-		if (ss->noiseframes > SPHINX_NOISE_FRAMES) {
+		if (ss->noiseframes > ss->maxnoiseframes) {
 			/* ast_log(LOG_NOTICE, "Detected speech.\n"); */
 			ss->heardspeech = 1;
 			ss->noiseframes = 0;
 			speech->flags |= AST_SPEECH_QUIET;
 			speech->flags |= AST_SPEECH_SPOKE;
 		}
-	} else if (ss->heardspeech && silence && totalsil > SPHINX_SILENCE_TIME) {
+	} else if (ss->heardspeech && silence && totalsil > ss->endpoint) {
 		/* ast_log(LOG_NOTICE, "Detected %d finishing silence.\n", totalsil); */
+		if (SPHINX_LEARN_ENDPOINT && len)
+			sphinx_endpoint_learn(ss->grammar, ss->maxpause, ss->speechms - totalsil);
 		/* sending 0 bytes in a DATA request is another way to wrap-up. */
 		len = 0;
 	} else if (silence)
 		ss->noiseframes = 0;
 
-	sr.dlen = len;
-	sr.rtype = REQTYPE_DATA;
-	sr.data = data;
+	/* Pauses speech resumes after, to learn how long this grammar's endpoint must be */
+	if (ss->heardspeech && len) {
+		ss->speechms += len / 16;
+		if (silence) {
+			ss->pause = totalsil;
+		} else {
+			if (ss->pause > ss->maxpause)
+				ss->maxpause = ss->pause;
+			ss->pause = 0;
+		}
+	}
+
+	/* A hypothesis that has settled in a grammar end state will not change, stop now */
+	if (len && ss->stablefinish && ss->heardspeech && ss->partialend &&
+		!ast_strlen_zero(ss->partial)) {
+		ss->stablefor += len / 16;
+		if (ss->stablefor >= ss->stablefinish) {
+			ast_log(LOG_DEBUG, "'%s' stable for %d ms, finishing\n", ss->partial, ss->stablefor);
+			ast_atomic_fetchadd_int(&latency_stats.early, 1);
+			len = 0;
+		}
+	}
+
+	/* However long the caller carries on, the utterance ends at its deadline */
+	if (len && ss->deadline) {
+		ss->uttms += len / 16;
+		if (ss->uttms >= ss->deadline) {
+			ast_log(LOG_NOTICE, "Utterance reached its %d ms deadline, finishing\n", ss->deadline);
+			ast_atomic_fetchadd_int(&latency_stats.deadlines, 1);
+			ss->deadlined = 1;
+			ss->deadline_tv = ast_tvnow();
+			len = 0;
+		}
+	}
 
-	finish = 0;
-	if (sr.dlen == 0)
-		finish = 1;
-	if (sphinx_comm(&sr, speech, finish) != SPHINX_SUCCESS) {
+	if (sphinx_send_audio(speech, data, len, silence && !ss->heardspeech) != SPHINX_SUCCESS) {
 		ast_log(LOG_ERROR, "Comms error, changing state to NOT_READY\n");
 		ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
 		return -1;
@@ -534,30 +4954,449 @@ int sphinx_write(struct ast_speech *speech, void *data, int len)
 
 }
 
-/*! \brief Does nothing - stub for compatibility. */
+/*! \brief
+ * Sends one DATA request of SLINEAR audio, or of cepstra computed here when the
+ * server takes SPHINX_CAP_FEATURES.  len 0 ends the utterance.
+ */
+int sphinx_send_audio(struct ast_speech *speech, void *data, int len, int silent)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct sphinx_request sr;
+	float cep[SPHINX_FE_MAXFRAMES * SPHINX_FE_NCEP];
+	char feat[sizeof(cep)];
+	int nframes, i;
+
+	if (ss->shadow)
+		sphinx_shadow_audio(ss, data, len);
+	if (ss->local)
+		return sphinx_local_audio(speech, data, len, silent);
+
+	sr.rtype = REQTYPE_DATA;
+	sr.data = data;
+	sr.dlen = len;
+	sr.silent = silent;
+
+	if (ss->caps & SPHINX_CAP_FEATURES) {
+		if (len / 2 > (SPHINX_FE_MAXFRAMES - 2) * SPHINX_FE_SHIFT)
+			return make_error(speech, "Audio frame too large for feature extraction\n");
+		nframes = sphinx_fe_process(&ss->fe, data, len / 2, cep);
+		if (len == 0 && !ss->final)
+			nframes += sphinx_fe_flush(&ss->fe, cep + nframes * SPHINX_FE_NCEP);
+		for (i = 0; i < nframes * SPHINX_FE_NCEP; i++) {
+			uint32_t v;
+			memcpy(&v, &cep[i], sizeof(v));
+			sphinx_put32(feat + i * sizeof(v), v);
+		}
+		sr.data = feat;
+		sr.dlen = nframes * SPHINX_FE_NCEP * sizeof(float);
+
+		/* Not a whole window yet */
+		if (len && sr.dlen == 0)
+			return SPHINX_SUCCESS;
+
+		/* The last frame goes out ahead of the empty request that ends the utterance */
+		if (len == 0 && sr.dlen) {
+			if (sphinx_comm(&sr, speech, 0) != SPHINX_SUCCESS)
+				return SPHINX_ERROR;
+			sr.dlen = 0;
+		}
+	}
+
+	return sphinx_comm(&sr, speech, sr.dlen == 0);
+}
+
+/*! \brief Hand a final session to the notifier thread to read its results */
+int sphinx_notify_register(struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ss };
+
+	ast_mutex_lock(&notify_lock);
+	if (!ss->notifying) {
+		if (epoll_ctl(notify_epfd, EPOLL_CTL_ADD, ss->s, &ev) == -1) {
+			ast_mutex_unlock(&notify_lock);
+			return make_error(speech, "Cannot watch Sphinx socket for results\n");
+		}
+		ss->speech = speech;
+		ss->notifying = 1;
+		ss->notify_tv = ast_tvnow();
+		AST_LIST_INSERT_TAIL(&notify_list, ss, notify_entry);
+	}
+	ast_mutex_unlock(&notify_lock);
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Take a session back from the notifier, before touching its socket */
+void sphinx_notify_unregister(struct sphinx_state *ss)
+{
+	ast_mutex_lock(&notify_lock);
+	if (ss->notifying) {
+		ss->notifying = 0;
+		epoll_ctl(notify_epfd, EPOLL_CTL_DEL, ss->s, NULL);
+		AST_LIST_REMOVE(&notify_list, ss, notify_entry);
+	}
+	ast_mutex_unlock(&notify_lock);
+}
+
+/*! \brief Final results are complete: mark DONE and wake any waiter */
+void sphinx_publish_result(struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+
+	ss->published = 1;
+	ss->inutterance = 0;
+	ss->result_tv = ast_tvnow();
+	if (speech->results != NULL)
+		speech->flags |= AST_SPEECH_HAVE_RESULTS;
+	if (ss->shadow)
+		sphinx_shadow_result(speech);
+	ast_speech_change_state(speech, AST_SPEECH_STATE_DONE);
+	if (ss->efd)
+		eventfd_write(ss->efd, 1);
+}
+
+/*! \brief Block until final results are published */
+int sphinx_wait_result(struct ast_speech *speech, int timeout)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct pollfd pfd;
+
+	if (ss == NULL || !ss->efd)
+		return -1;
+
+	pfd.fd = ss->efd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, timeout) == -1)
+		return errno == EINTR ? 0 : -1;
+	return (pfd.revents & POLLIN) ? 1 : 0;
+}
+
+/*! \brief
+ * Tell the server to stop decoding the current utterance.  Servers that know
+ * REQTYPE_CANCEL drop it outright; older ones get the usual zero-length DATA
+ * wrap-up.  Either way every response still due is thrown away unread, and we
+ * do not wait for any of them here.
+ */
+int sphinx_cancel(struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct sphinx_request sr;
+	char hdr[SPHINX_REQHDR_V1];
+
+	if (ss == NULL || ss->s == 0)
+		return SPHINX_SUCCESS;
+
+	sr.rtype = (ss->caps & SPHINX_CAP_CANCEL) ? REQTYPE_CANCEL : REQTYPE_DATA;
+	sr.dlen = 0;
+	sr.data = NULL;
+	sr.silent = 0;
+
+	/* An old server that already has its wrap-up needs nothing more */
+	if (sr.rtype == REQTYPE_CANCEL || !ss->final) {
+		if (sphinx_make_room(&sr, speech) != SPHINX_SUCCESS)
+			return SPHINX_ERROR;
+		if (sphinx_swrite(ss, hdr, sphinx_reqhdr(ss, &sr, hdr)) != SPHINX_SUCCESS)
+			return make_error(speech, "Socket write error sending cancel\n");
+		if (sr.rtype != REQTYPE_CANCEL)
+			ss->preads++;
+		if (ss->capture)
+			sphinx_capture(ss, SPHINX_CAPTURE_REQUEST, sr.rtype, ss->utterance, NULL, 0);
+	}
+
+	/* Everything due now is stale; with v1 framing the new sequence number says so too */
+	ss->discard = ss->preads + (ss->prbytes ? 1 : 0);
+	if (ss->proto)
+		ss->utterance++;
+	ss->final = 1;
+	ss->inutterance = 0;
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Queue one capture record, stamped relative to the previous one */
+void sphinx_capture(struct sphinx_state *ss, int dir, unsigned int type,
+					unsigned int seq, const char *data, int len)
+{
+	char hdr[SPHINX_CAPTURE_RECHDR];
+	struct timeval now = ast_tvnow();
+	uint64_t usec = ast_tvdiff_us(now, ss->capture_tv);
+
+	hdr[0] = dir;
+	sphinx_put32(hdr + 1, usec);
+	sphinx_put32(hdr + 5, usec >> 32);
+	sphinx_put32(hdr + 9, type);
+	sphinx_put32(hdr + 13, seq);
+	sphinx_put32(hdr + 17, len);
+
+	/* A dropped record's time is carried by the next one that makes it */
+	if (sphinx_capture_queue(ss->capture, hdr, sizeof(hdr), data, len, 0) == SPHINX_SUCCESS)
+		ss->capture_tv = now;
+}
+
+/*! \brief Start a capture file for a fresh connection */
+void sphinx_capture_open(struct sphinx_state *ss)
+{
+	char path[PATH_MAX];
+	struct timeval now = ast_tvnow();
+
+	if (snprintf(path, sizeof(path), "%s/%s-%ld-%d.cap", SPHINX_CAPTURE_DIR, AST_MODULE,
+				 (long) now.tv_sec, ast_atomic_fetchadd_int(&capture_files, 1)) >= sizeof(path)) {
+		ast_log(LOG_WARNING, "Capture directory %s is too long for a capture file name\n",
+				SPHINX_CAPTURE_DIR);
+		return;
+	}
+	if ((ss->capture = fopen(path, "w")) == NULL) {
+		ast_log(LOG_WARNING, "Cannot open capture file %s: %s\n", path, strerror(errno));
+		return;
+	}
+	ss->capture_tv = now;
+	/* Without its magic the file is useless; nothing else is queued for it yet */
+	if (sphinx_capture_queue(ss->capture, SPHINX_CAPTURE_MAGIC, sizeof(SPHINX_CAPTURE_MAGIC) - 1,
+							 NULL, 0, 0) != SPHINX_SUCCESS) {
+		fclose(ss->capture);
+		unlink(path);
+		ss->capture = NULL;
+	}
+}
+
+/*! \brief The writer closes the file once everything before it is written */
+void sphinx_capture_close(struct sphinx_state *ss)
+{
+	if (ss->capture == NULL)
+		return;
+	sphinx_capture_queue(ss->capture, NULL, 0, NULL, 0, 1);
+	ss->capture = NULL;
+}
+
+/*! \brief Wait up to ms for pending writes to reach the socket */
+int sphinx_drain_writes(struct sphinx_state *ss, int ms)
+{
+	struct timeval deadline = ast_tvadd(ast_tvnow(), ast_samp2tv(ms, 1000));
+	int left;
+
+	while (ss->pwbytes && (left = ast_tvdiff_ms(deadline, ast_tvnow())) > 0) {
+		fd_set wsel;
+		struct timeval tv;
+
+		FD_ZERO(&wsel);
+		FD_SET(ss->s, &wsel);
+		tv.tv_sec = left / 1000;
+		tv.tv_usec = (left % 1000) * 1000;
+
+		if (select(ss->s + 1, NULL, &wsel, NULL, &tv) == -1 && errno != EINTR)
+			return SPHINX_ERROR;
+		if (FD_ISSET(ss->s, &wsel) && sphinx_swrite(ss, NULL, 0) != SPHINX_SUCCESS)
+			return SPHINX_ERROR;
+	}
+	return ss->pwbytes ? SPHINX_ERROR : SPHINX_SUCCESS;
+}
+
+/*! \brief DTMF ends the utterance, digits become the result */
 int sphinx_dtmf(struct ast_speech *speech, const char *dtmf)
 {
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct ast_speech_result *res;
+	char *text;
+
 	/* ast_log(LOG_DEBUG, "sphinx_dtmf called with %s\n", dtmf); */
+	if (ss == NULL || ast_strlen_zero(dtmf))
+		return 0;
+
+	sphinx_notify_unregister(ss);
+	sphinx_local_cancel(ss);
+	if (ss->inutterance && sphinx_cancel(speech) != SPHINX_SUCCESS)
+		return -1;
+
+	if (speech->results == NULL &&
+		(speech->results = ast_calloc(sizeof(struct ast_speech_result), 1)) == NULL)
+		return -1;
+	res = speech->results;
+
+	/* Speech is superseded; digits from earlier calls are kept and appended to */
+	if (res->grammar == NULL || strcmp(res->grammar, "dtmf")) {
+		ast_free(res->text);
+		ast_free(res->grammar);
+		res->text = NULL;
+		res->grammar = ast_strdup("dtmf");
+	}
+	if ((text = ast_malloc((res->text ? strlen(res->text) : 0) + strlen(dtmf) + 1)) == NULL)
+		return -1;
+	sprintf(text, "%s%s", S_OR(res->text, ""), dtmf);
+	ast_free(res->text);
+	res->text = text;
+	res->score = 1000;
+
+	ast_log(LOG_NOTICE, "DTMF barge-in: '%s'\n", res->text);
+	sphinx_publish_result(speech);
 	return 0;
 }
 
 /*! brief Prepare to accept speech data (via sphinx_write) */
 int sphinx_start(struct ast_speech *speech)
 {
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	struct sphinx_backend *reconnect = NULL;
+
 	/* ast_log(LOG_DEBUG, "sphinx_start called - changing to ready state\n"); */
+	/* The connection died since the last prompt: start over on a fresh one */
+	if (ss != NULL && ss->s && ss->backend && !sphinx_alive(ss)) {
+		reconnect = ss->backend;
+		ast_log(LOG_WARNING, "Connection to Sphinx server %s:%d is gone, reconnecting\n",
+				reconnect->host, reconnect->port);
+		sphinx_breaker_report(reconnect, 0);
+		sphinx_disconnect(speech);
+	}
+
+	/* Restarted mid-utterance: free the server's decoder and skip its answers */
+	if (ss != NULL && ss->inutterance) {
+		sphinx_notify_unregister(ss);
+		if (sphinx_cancel(speech) != SPHINX_SUCCESS) {
+			ast_log(LOG_ERROR, "Cannot cancel previous utterance, setting NOT READY\n");
+			return -1;
+		}
+	}
 	if (reinit_speech_data(speech) != SPHINX_SUCCESS) {
 		ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
 		ast_log(LOG_ERROR, "Cannot reinit speech object, setting NOT READY\n");
 		return -1;
 	}
+	if (reconnect != NULL &&
+		(!sphinx_breaker_allow(reconnect) || sphinx_connect(speech, reconnect) != SPHINX_SUCCESS ||
+		 (ss->ngrammars && !ss->local && sphinx_send_grammars(speech) != SPHINX_SUCCESS))) {
+		sphinx_breaker_report(reconnect, 0);
+		ast_speech_change_state(speech, AST_SPEECH_STATE_NOT_READY);
+		ast_log(LOG_ERROR, "Cannot reconnect to Sphinx server, setting NOT READY\n");
+		return -1;
+	}
 	ast_speech_change_state(speech, AST_SPEECH_STATE_READY);
 	return 0;
 }
 
-/*! \brief Does nothing - stub for compatibility. */
+/*! \brief Send one "name=value" decoder setting, len including its terminator */
+static int sphinx_tune_send(struct ast_speech *speech, const char *setting, int len)
+{
+	struct sphinx_request sr;
+
+	sr.rtype = REQTYPE_TUNE;
+	sr.dlen = len;
+	sr.data = (char *) setting;
+	sr.silent = 0;
+	return sphinx_comm(&sr, speech, 0);
+}
+
+/*! \brief Keep a setting for sphinx_tune_replay(), replacing any earlier value of the same name */
+static int sphinx_tune_remember(struct sphinx_state *ss, const char *setting, int len)
+{
+	int namelen = strchr(setting, '=') - setting + 1, off, n;
+	char *tunes;
+
+	for (off = 0; off < ss->tuneslen; off += n) {
+		n = strlen(ss->tunes + off) + 1;
+		if (!strncmp(ss->tunes + off, setting, namelen)) {
+			memmove(ss->tunes + off, ss->tunes + off + n, ss->tuneslen - off - n);
+			ss->tuneslen -= n;
+			break;
+		}
+	}
+	if ((tunes = realloc(ss->tunes, ss->tuneslen + len)) == NULL)
+		return SPHINX_ERROR;
+	memcpy(tunes + ss->tuneslen, setting, len);
+	ss->tunes = tunes;
+	ss->tuneslen += len;
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Send every setting the session has made, in the order last made */
+int sphinx_tune_replay(struct ast_speech *speech)
+{
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	int off, n;
+
+	if (!(ss->caps & SPHINX_CAP_TUNE)) {
+		ast_log(LOG_WARNING, "Sphinx server does not accept decoder settings, this session's are lost\n");
+		return SPHINX_SUCCESS;
+	}
+	for (off = 0; off < ss->tuneslen; off += n) {
+		n = strlen(ss->tunes + off) + 1;
+		if (sphinx_tune_send(speech, ss->tunes + off, n) != SPHINX_SUCCESS)
+			return SPHINX_ERROR;
+	}
+	return SPHINX_SUCCESS;
+}
+
+/*! \brief Per-session endpointing settings, or decoder settings for the server */
 int sphinx_change(struct ast_speech *speech, char *name, const char *value)
 {
+	struct sphinx_state *ss = (struct sphinx_state *) speech->data;
+	char buf[128];
+	int num, len;
+
 	/* ast_log(LOG_DEBUG, "sphinx_change called name %s val %s\n", name, value); */
+	if (ss == NULL || ast_strlen_zero(name) || value == NULL)
+		return -1;
+
+	/*
+	 * The class applies to what the session queues for from now on.  Its slot
+	 * was taken in sphinx_create(), which has no channel to ask, so that is
+	 * only the local decoder queue.
+	 */
+	if (!strcasecmp(name, "priority")) {
+		for (num = 0; num < SPHINX_PRIO_CLASSES; num++) {
+			if (!strcasecmp(value, priority_names[num]))
+				break;
+		}
+		if (num == SPHINX_PRIO_CLASSES) {
+			ast_log(LOG_WARNING, "Invalid value '%s' for %s\n", value, name);
+			return -1;
+		}
+		ss->priority = num;
+		return 0;
+	}
+
+	if (!strcasecmp(name, "silencetime") || !strcasecmp(name, "silencethreshold") ||
+		!strcasecmp(name, "noiseframes") || !strcasecmp(name, "stablefinish") ||
+		!strcasecmp(name, "deadline") || !strcasecmp(name, "deadlinewait")) {
+		if (sscanf(value, "%d", &num) != 1 || num < 0) {
+			ast_log(LOG_WARNING, "Invalid value '%s' for %s\n", value, name);
+			return -1;
+		}
+		if (!strcasecmp(name, "silencetime")) {
+			ss->silencetime = num;
+			ss->endpoint = num;
+			ss->silenceset = 1;
+		} else if (!strcasecmp(name, "silencethreshold")) {
+			ss->silencethreshold = num;
+			if (ss->dsp != NULL)
+				ast_dsp_set_threshold(ss->dsp, num);
+		} else if (!strcasecmp(name, "stablefinish")) {
+			ss->stablefinish = num;
+		} else if (!strcasecmp(name, "deadline")) {
+			ss->deadline = num;
+		} else if (!strcasecmp(name, "deadlinewait")) {
+			ss->deadlinewait = num;
+		} else {
+			ss->maxnoiseframes = num;
+		}
+		return 0;
+	}
+
+	/* Anything else is for the decoder; it applies from the next audio on */
+	if (!(ss->caps & SPHINX_CAP_TUNE)) {
+		ast_log(LOG_WARNING, "Sphinx server does not accept decoder setting '%s'\n", name);
+		return -1;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%s=%s", name, value) + 1;
+	if (len > sizeof(buf)) {
+		ast_log(LOG_WARNING, "Decoder setting '%s' too long\n", name);
+		return -1;
+	}
+	if (sphinx_tune_send(speech, buf, len) != SPHINX_SUCCESS) {
+		ast_log(LOG_ERROR, "Comms error sending decoder setting\n");
+		return -1;
+	}
+	if (sphinx_tune_remember(ss, buf, len) != SPHINX_SUCCESS)
+		ast_log(LOG_WARNING, "Decoder setting '%s' will not survive a reconnect\n", name);
 	return 0;
 }
 
@@ -591,6 +5430,18 @@ int sphinx_change_results_type(struct ast_speech *speech,
 /*! \brief Returns the current speech results */
 struct ast_speech_result *sphinx_get(struct ast_speech *speech)
 {
+	struct sphinx_state *ss;
+
+	if (speech != NULL && (ss = (struct sphinx_state *) speech->data) != NULL &&
+		!ast_tvzero(ss->result_tv)) {
+		int ms = ast_tvdiff_ms(ast_tvnow(), ss->result_tv);
+
+		ast_atomic_fetchadd_int(&latency_stats.results, 1);
+		ast_atomic_fetchadd_int(&latency_stats.total_ms, ms);
+		sphinx_stat_max(&latency_stats.max_ms, ms);
+		ss->result_tv = ast_tv(0, 0);
+	}
+
 	if (speech != NULL) {
 		if (speech->results != NULL) {
 			return speech->results;
@@ -601,8 +5452,10 @@ struct ast_speech_result *sphinx_get(struct ast_speech *speech)
 }
 
 /*! \brief connects to sphinx server */
-int sphinx_connect(struct ast_speech *speech, char const *host, const int port)
+int sphinx_connect(struct ast_speech *speech, struct sphinx_backend *be)
 {
+	char const *host = be->host;
+	const int port = be->port;
 	struct sockaddr_in sin;
 	struct hostent *hp;
 	struct ast_hostent ahp;
@@ -632,6 +5485,7 @@ int sphinx_connect(struct ast_speech *speech, char const *host, const int port)
 		ss->s = 0;
 		return SPHINX_ERROR;
 	}
+	sphinx_set_sockopts(ss);
 
 	/* Make connection */
 	sin.sin_family = AF_INET;
@@ -643,19 +5497,57 @@ int sphinx_connect(struct ast_speech *speech, char const *host, const int port)
 		ss->s = 0;
 		return SPHINX_ERROR;
 	}
+	ss->backend = be;
+	ast_atomic_fetchadd_int(&be->sessions, 1);
 
 	ast_log(LOG_DEBUG, "Connect to %s:%d completed.\n", host, port);
 
 	/* No need to get messy with non-blocking, now that we're connected we'll get that rolling */
 	if (sphinx_set_blocking(ss->s, 0) != SPHINX_SUCCESS) {
-		close(ss->s);
-		ss->s = 0;
+		sphinx_disconnect(speech);
 		return make_error(speech, "Cannot set blocking mode.\n");
 	}
 
+	if (SPHINX_CAPTURE)
+		sphinx_capture_open(ss);
+
+	if (SPHINX_HANDSHAKE && sphinx_handshake(speech) != SPHINX_SUCCESS) {
+		sphinx_disconnect(speech);
+		return make_error(speech, "Protocol handshake failed.\n");
+	}
+	if ((ss->caps & SPHINX_CAP_DATAGRAM) && sphinx_dgram_open(ss, &sin) != SPHINX_SUCCESS) {
+		ast_log(LOG_WARNING, "Cannot open datagram socket, audio goes by the stream: %s\n",
+				strerror(errno));
+		ss->caps &= ~SPHINX_CAP_DATAGRAM;
+	}
+	/* A reconnect must not lose what sphinx_change() told the last server */
+	if (ss->tuneslen && sphinx_tune_replay(speech) != SPHINX_SUCCESS) {
+		sphinx_disconnect(speech);
+		return make_error(speech, "Cannot restore decoder settings.\n");
+	}
+
 	return SPHINX_SUCCESS;
 }
 
+/*! \brief Apply the session's socket profile; buffer sizes must precede connect() */
+void sphinx_set_sockopts(struct sphinx_state *ss)
+{
+	if (ss->sock.nodelay && setsockopt(ss->s, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int)))
+		ast_log(LOG_WARNING, "Cannot set TCP_NODELAY: %s\n", strerror(errno));
+	if (ss->sock.sndbuf &&
+		setsockopt(ss->s, SOL_SOCKET, SO_SNDBUF, &ss->sock.sndbuf, sizeof(ss->sock.sndbuf)))
+		ast_log(LOG_WARNING, "Cannot set SO_SNDBUF: %s\n", strerror(errno));
+	if (ss->sock.rcvbuf &&
+		setsockopt(ss->s, SOL_SOCKET, SO_RCVBUF, &ss->sock.rcvbuf, sizeof(ss->sock.rcvbuf)))
+		ast_log(LOG_WARNING, "Cannot set SO_RCVBUF: %s\n", strerror(errno));
+	if (ss->sock.keepidle &&
+		(setsockopt(ss->s, SOL_SOCKET, SO_KEEPALIVE, &(int){1}, sizeof(int)) ||
+		 setsockopt(ss->s, IPPROTO_TCP, TCP_KEEPIDLE, &ss->sock.keepidle, sizeof(int)) ||
+		 setsockopt(ss->s, IPPROTO_TCP, TCP_KEEPINTVL, &ss->sock.keepintvl, sizeof(int)) ||
+		 setsockopt(ss->s, IPPROTO_TCP, TCP_KEEPCNT, &ss->sock.keepcnt, sizeof(int))))
+		ast_log(LOG_WARNING, "Cannot set TCP keepalive: %s\n", strerror(errno));
+}
+
 /*! \brief init or re-init object data */
 int reinit_speech_data(struct ast_speech *speech)
 {
@@ -665,31 +5557,80 @@ int reinit_speech_data(struct ast_speech *speech)
 	if (speech == NULL)
 		return SPHINX_ERROR;
 	if (speech->data == NULL) {
-		speech->data = ast_calloc(sizeof(struct ast_speech), 1);
+		speech->data = ast_calloc(sizeof(struct sphinx_state), 1);
 		if (speech->data == NULL)
 			return SPHINX_ERROR;
+		ss = (struct sphinx_state *) speech->data;
+		ss->silencetime = SPHINX_SILENCE_TIME;
+		ss->silencethreshold = SPHINX_SILENCE_THRESHOLD;
+		ss->maxnoiseframes = SPHINX_NOISE_FRAMES;
+		ss->stablefinish = SPHINX_STABLE_FINISH;
+		ss->deadline = SPHINX_DEADLINE;
+		ss->deadlinewait = SPHINX_DEADLINE_WAIT;
+		ss->sock = SPHINX_SOCKPROFILE;
+		ss->priority = create_priority >= 0 ? create_priority : SPHINX_PRIORITY;
 	}
 
 	ss = (struct sphinx_state *) speech->data;
+	ss->speech = speech;
+	sphinx_notify_unregister(ss);
+	sphinx_local_cancel(ss);
+	ss->lsamples = 0;
+	if (ss->shadow)
+		sphinx_shadow_cancel(ss);
 
 	if (ss->dsp != NULL) {
 		ast_dsp_free(ss->dsp);
 		ss->dsp = NULL;
 	}
 
-	if (ss->preads || ss->pwbytes || ss->prbytes) {
+	/* Leftovers of a cancelled utterance stay queued; sphinx_sread discards them */
+	if (ss->discard < ss->preads + (ss->prbytes ? 1 : 0)) {
 		ast_log(LOG_ERROR,
 				"Pending reads: %d, bytes in current read: %d - WE DO NOT EXPECT PENDING READS HERE!\n",
 				ss->preads, ss->pwbytes);
 		/* TODO: handle this case better. */
+		ss->prbytes = 0;
+		ss->pwbytes = 0;
+		ss->preads = 0;
+		ss->rbufused = 0;
+		ss->rhdrused = 0;
+		ss->discard = 0;
 	}
 	ss->heardspeech = 0;
 	ss->noiseframes = 0;
 	ss->final = 0;
-	ss->prbytes = 0;
-	ss->pwbytes = 0;
-	ss->preads = 0;
-	ss->rbufused = 0;
+	ss->inutterance = 0;
+	sphinx_fe_reset(&ss->fe);
+	ss->pause = 0;
+	ss->maxpause = 0;
+	ss->speechms = 0;
+	ss->endpoint = ss->silenceset ? 0 : sphinx_endpoint_get(ss->grammar);
+	if (!ss->endpoint)
+		ss->endpoint = ss->silencetime;
+	free(ss->partial);
+	ss->partial = NULL;
+	ss->partialend = 0;
+	ss->partialshown = 0;
+	ss->stablefor = 0;
+	ss->uttms = 0;
+	ss->deadlined = 0;
+	ss->utterance++;
+	ss->published = 0;
+	ss->result_tv = ast_tv(0, 0);
+
+	if (SPHINX_NOTIFY && !ss->efd) {
+		if ((ss->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			ast_log(LOG_WARNING, "Cannot create eventfd, results will be polled\n");
+			ss->efd = 0;
+		}
+	} else if (ss->efd) {
+		eventfd_t drain;
+		eventfd_read(ss->efd, &drain);
+	}
+	ss->wqueued = ss->pwbytes;
+	ss->wsent = 0;
+	ss->nqframes = 0;
 	ss->dsp = ast_dsp_new();
 	if (ss->dsp == NULL) {
 		ast_log(LOG_ERROR, "Unable to create silence detection DSP\n");
@@ -697,18 +5638,11 @@ int reinit_speech_data(struct ast_speech *speech)
 		speech->data = NULL;
 		return SPHINX_ERROR;
 	}
-	ast_dsp_set_threshold(ss->dsp, SPHINX_SILENCE_THRESHOLD);
-
-	if (ss->rbuf != NULL) {
-		free(ss->rbuf);
-		ss->rbuf = NULL;
-	}
-	if (ss->sbuf != NULL) {
-		free(ss->sbuf);
-		ss->sbuf = NULL;
-	}
+	ast_dsp_set_threshold(ss->dsp, ss->silencethreshold);
 
-	ss->rbuf = ast_calloc(SPHINX_BUFSIZE, 1);
+	/* Buffers live as long as the session, they may hold a cancelled utterance's tail */
+	if (ss->rbuf == NULL)
+		ss->rbuf = ast_calloc(SPHINX_BUFSIZE, 1);
 	if (ss->rbuf == NULL) {
 		ast_dsp_free(ss->dsp);
 		ss->dsp = NULL;
@@ -717,7 +5651,8 @@ int reinit_speech_data(struct ast_speech *speech)
 		return SPHINX_ERROR;
 	}
 
-	ss->sbuf = ast_calloc(SPHINX_BUFSIZE, 1);
+	if (ss->sbuf == NULL)
+		ss->sbuf = ast_calloc(SPHINX_BUFSIZE, 1);
 	if (ss->sbuf == NULL) {
 		ast_dsp_free(ss->dsp);
 		ss->dsp = NULL;
@@ -744,6 +5679,8 @@ int destroy_speech_data(struct ast_speech *speech)
 		return SPHINX_ERROR;
 
 	ss = (struct sphinx_state *) speech->data;
+	sphinx_local_cancel(ss);
+	ast_free(ss->lbuf);
 
 	if (ss->rbuf != NULL) {
 		free(ss->rbuf);
@@ -758,6 +5695,12 @@ int destroy_speech_data(struct ast_speech *speech)
 		ast_dsp_free(ss->dsp);
 		ss->dsp = NULL;
 	}
+	if (ss->efd) {
+		close(ss->efd);
+		ss->efd = 0;
+	}
+	free(ss->partial);
+	free(ss->tunes);
 	free(ss);
 	speech->data = NULL;
 	return SPHINX_SUCCESS;
@@ -770,9 +5713,30 @@ int sphinx_disconnect(struct ast_speech *speech)
 	if (ss == NULL)
 		return SPHINX_SUCCESS;
 
+	sphinx_notify_unregister(ss);
+	sphinx_capture_close(ss);
+	sphinx_dgram_close(ss);
+	ss->dgram_utt = ss->dgram_frames = 0;
 	if (ss->s != 0) {
 		close(ss->s);
+		ss->s = 0;
 	}
+	if (ss->backend != NULL) {
+		ast_atomic_fetchadd_int(&ss->backend->sessions, -1);
+		ss->backend = NULL;
+	}
+	ss->proto = 0;
+	ss->caps = 0;
+
+	/* Nothing is owed on a connection that no longer exists */
+	ss->preads = 0;
+	ss->prbytes = 0;
+	ss->pwbytes = 0;
+	ss->rbufused = 0;
+	ss->rhdrused = 0;
+	ss->discard = 0;
+	ss->nqframes = 0;
+	ss->inutterance = 0;
 	ast_log(LOG_DEBUG, "DISCONNECTED\n");
 	return SPHINX_SUCCESS;
 }
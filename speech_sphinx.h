@@ -64,7 +64,9 @@ int sphinx_unload(struct ast_speech *speech, char *grammar_name);
  * \param grammar_name Name of grammar to activate
  *
  * Unlike loading a grammar, activating the grammar is critical; this determines
- * which set of words the sphinx server will be listening for.
+ * which set of words the sphinx server will be listening for.  A server with
+ * SPHINX_CAP_MULTIGRAMMAR listens for every active grammar at once; any other
+ * server only for the last one activated.
  */
 int sphinx_activate(struct ast_speech *speech, char *grammar_name);
 
@@ -73,9 +75,10 @@ int sphinx_activate(struct ast_speech *speech, char *grammar_name);
  * \param speech Speech API object
  * \param grammar_name Name of grammar to deactivate
  *
- * This does not actually deactivate the current grammar, but if you make sure it is
- * called before looking for results (as in typical operation) this does signal to
- * Sphinx server that it is the last chance to provide final results.  A good idea.
+ * If you make sure it is called before looking for results (as in typical
+ * operation) this signals to Sphinx server that it is the last chance to provide
+ * final results.  A good idea.  With several grammars active, it also drops
+ * grammar_name from the set for the next utterance.
  */
 int sphinx_deactivate(struct ast_speech *speech, char *grammar_name);
 
@@ -90,11 +93,12 @@ int sphinx_deactivate(struct ast_speech *speech, char *grammar_name);
 int sphinx_write(struct ast_speech *speech, void *data, int len);
 
 /*! 
- * \brief Stub Function
+ * \brief DTMF barge-in
  * \param speech Speech API object
+ * \param dtmf Digits the caller pressed
  *
- * These are stub functions that always return true, only included to be 
- * sure of source-level compatibility with other engines. 
+ * Ends the utterance at once: the digits become the result (grammar "dtmf")
+ * and the server is told to stop decoding audio we no longer care about.
  */
 int sphinx_dtmf(struct ast_speech *speech, const char *dtmf);
 
@@ -107,11 +111,15 @@ int sphinx_dtmf(struct ast_speech *speech, const char *dtmf);
 int sphinx_start(struct ast_speech *speech);
 
 /*! 
- * \brief Stub Function
+ * \brief Change a per-session setting
  * \param speech Speech API object
+ * \param name Setting, as given to SpeechEngine()
+ * \param value New value
  *
- * These are stub functions that always return true, only included to be 
- * sure of source-level compatibility with other engines. 
+ * silencetime, silencethreshold, noiseframes and stablefinish override the
+ * sphinx.conf values for this session; setting silencetime also turns off the
+ * learned endpoint for it.  Any other name is a decoder parameter (beam, maxhmmpf, ...)
+ * forwarded to the server, which needs SPHINX_CAP_TUNE.
  */
 int sphinx_change(struct ast_speech *speech, char *name, const char *value);
 
@@ -133,6 +141,146 @@ int sphinx_change_results_type(struct ast_speech *speech,
  */
 struct ast_speech_result *sphinx_get(struct ast_speech *speech);
 
+/*! 
+ * \brief Wait for final results
+ * \param speech Speech API object
+ * \param timeout Milliseconds to wait, -1 for ever
+ *
+ * With notify enabled, final results are read as soon as the server sends them
+ * rather than on the next sphinx_write, and the speech object is moved to DONE.
+ * Returns 1 once results (or an error) are in, 0 on timeout, -1 if the session
+ * does not use notification.
+ */
+int sphinx_wait_result(struct ast_speech *speech, int timeout);
+
+/*! \brief How small writes are coalesced into segments */
+enum e_cork {
+	SPHINX_CORK_NONE,			/* Header and payload are written as they come */
+	SPHINX_CORK_MSGMORE,		/* Header written with MSG_MORE */
+	SPHINX_CORK_CORK			/* TCP_CORK held around header and payload */
+};
+
+/*! \brief Socket options applied when connecting */
+struct sphinx_sockprofile {
+	int nodelay;				/* TCP_NODELAY */
+	int cork;					/* enum e_cork */
+	int quickack;				/* TCP_QUICKACK while reading final results */
+	int sndbuf;					/* SO_SNDBUF, 0 for the kernel default */
+	int rcvbuf;					/* SO_RCVBUF, 0 for the kernel default */
+	int keepidle;				/* Seconds idle before TCP keepalive probes, 0 for none */
+	int keepintvl;				/* Seconds between keepalive probes */
+	int keepcnt;				/* Unanswered probes before the connection is dropped */
+};
+
+/*! \brief
+ * Traffic and health counters.  Every backend has SPHINX_STAT_SLOTS copies,
+ * each on its own cache line, and readers add them all up.  Threads take
+ * slots round robin, so with more threads than slots some share one: every
+ * update is atomic, and contention stays spread over the slots.
+ */
+struct sphinx_counters {
+	uint64_t bytes_sent;		/* Bytes written to the socket */
+	uint64_t bytes_recv;		/* Bytes read from the socket */
+	uint64_t frames;			/* DATA requests with audio */
+	uint64_t requests;			/* Requests of any kind */
+	uint64_t responses;			/* Complete responses */
+	uint64_t syscalls;			/* read/write/send/select calls */
+	uint64_t partial_writes;	/* Writes that left data in sbuf */
+	uint64_t overflows;			/* Send or receive buffer overflows */
+	uint64_t timeouts;			/* Gave up waiting on the server */
+	uint64_t errors;			/* Other socket errors */
+	int pwbytes_hwm;			/* Highest pwbytes seen */
+	int rbufused_hwm;			/* Highest rbufused seen */
+} __attribute__((aligned(64)));
+
+#define SPHINX_STAT_SLOTS 32
+
+/*! \brief Circuit breaker states */
+enum e_breaker {
+	SPHINX_BREAKER_CLOSED,		/* Server is healthy, sessions connect */
+	SPHINX_BREAKER_OPEN,		/* Server kept failing, sessions fail at once */
+	SPHINX_BREAKER_HALFOPEN		/* A ping is finding out whether it is back */
+};
+
+/*! \brief A recognition server */
+struct sphinx_backend {
+	char host[256];
+	int port;
+	int sessions;				/* Sessions connected right now */
+	int breaker;				/* enum e_breaker */
+	int failures;				/* Consecutive failures and timeouts */
+	int rejected;				/* Sessions refused while the breaker was open */
+	struct timeval opened;		/* When the breaker last opened */
+	int routed;					/* Sessions sent here for a grammar */
+	int spilled;				/* Of those, ones whose grammar belongs elsewhere */
+	struct sphinx_counters stats[SPHINX_STAT_SLOTS];
+};
+
+/*! \brief Most servers in servers= */
+#define SPHINX_MAX_BACKENDS 16
+/*! \brief Points each server takes on the grammar hash ring */
+#define SPHINX_RING_VNODES 100
+
+/*! \brief A point on the grammar hash ring */
+struct sphinx_ring_point {
+	uint32_t hash;
+	int backend;				/* Index into the server table */
+};
+
+/*! \brief
+ *
+ * Client-side front end, used when the server takes SPHINX_CAP_FEATURES.  It
+ * follows the Sphinx defaults for 8 kHz audio: pre-emphasis 0.97, a Hamming
+ * window of 205 samples every 80 (100 frames a second), a 256-point FFT, 31
+ * unit-area triangular mel filters from 200 to 3500 Hz, natural log and the
+ * legacy DCT down to 13 cepstra.  Each DATA payload is then whole frames of
+ * SPHINX_FE_NCEP little-endian float32.
+ *
+ */
+#define SPHINX_FE_RATE   8000
+#define SPHINX_FE_ALPHA  0.97f
+#define SPHINX_FE_WINDOW 205
+#define SPHINX_FE_SHIFT  80
+#define SPHINX_FE_NFFT   256
+#define SPHINX_FE_NBINS  (SPHINX_FE_NFFT / 2 + 1)
+#define SPHINX_FE_NFILT  31
+#define SPHINX_FE_LOWERF 200.0
+#define SPHINX_FE_UPPERF 3500.0
+#define SPHINX_FE_NCEP   13
+
+/*! \brief Front end state carried from one audio frame to the next */
+struct sphinx_fe {
+	float buf[SPHINX_FE_WINDOW];	/* Pre-emphasized samples not yet shifted out */
+	int nbuf;					/* How full is buf? */
+	float prior;				/* Last raw sample, for pre-emphasis */
+	int frames;					/* Frames produced this utterance */
+};
+
+/*! \brief
+ * Faults the test socket layer injects into session I/O.  Percentages are per
+ * call; reset is per million calls.
+ */
+struct sphinx_faults {
+	int fragment;				/* Most bytes one read or write moves, 0 for no limit */
+	int shortwrite;				/* % of writes cut to a random shorter length */
+	int eagain;					/* % of calls failing with EAGAIN */
+	int storm;					/* Further calls each EAGAIN also fails */
+	int delay;					/* ms added to every call */
+	int jitter;					/* Up to this many more ms, at random */
+	int reset;					/* Calls per million that reset the connection */
+	int loss;					/* % of audio datagrams dropped */
+	int reorder;				/* % of audio datagrams sent after the next one */
+};
+
+/*! \brief Most grammars one session can have active at once */
+#define SPHINX_MAX_GRAMMARS 8
+
+/*! \brief Max silent frames tracked in the send buffer for overload shedding */
+#define SPHINX_MAXQFRAMES 16
+
+/*! \brief Largest response header of any protocol version */
+#define SPHINX_RESPHDR_MAX 12
+
 /*! \brief 
  * Stores sphinx engine instance state. 
  *
@@ -151,6 +299,135 @@ struct sphinx_state {
 	int prbytes;				/* Bytes pending within a request */
 	int rbufused;				/* How full is rbuf? */
 	int pwbytes;				/* Bytes pending to write */
+	long long wqueued;			/* Total bytes ever queued to sbuf */
+	long long wsent;			/* Total bytes ever written from sbuf */
+	int nqframes;				/* Number of entries used in qframes */
+	struct sphinx_qframe {
+		long long start;		/* wqueued offset where the request begins */
+		int len;				/* Request length, header included */
+	} qframes[SPHINX_MAXQFRAMES];	/* Queued silent DATA requests we may shed */
+	int proto;					/* Negotiated protocol version, 0 is legacy */
+	unsigned int caps;			/* Capabilities both ends support */
+	int handshaking;			/* True while waiting for the HELLO reply */
+	int dgram;					/* UDP socket audio goes by, 0 for the stream */
+	int dgram_port;				/* Where the server takes it, from the handshake */
+	uint32_t dgram_token;		/* Names this connection in datagrams */
+	unsigned int dgram_utt;		/* Utterance the next two count for */
+	unsigned int dgram_frames;	/* Datagrams sent in it */
+	unsigned int dgram_ms;		/* Audio they covered, ms */
+	char *dgram_held;			/* Datagram the reorder fault holds back */
+	int dgram_heldlen;
+	unsigned int utterance;		/* Utterance sequence number, sent with v1 requests */
+	char rhdr[SPHINX_RESPHDR_MAX];	/* Response header being assembled */
+	int rhdrused;				/* How full is rhdr? */
+	unsigned int rkind;			/* Type of the response in rbuf */
+	unsigned int rseq;			/* Utterance the response in rbuf belongs to */
+	int discard;				/* Responses still due for a cancelled utterance */
+	int inutterance;			/* Audio sent and no final results published yet */
+	int silencetime;			/* Per-session silencetime */
+	int silencethreshold;		/* Per-session silencethreshold */
+	int maxnoiseframes;			/* Per-session noiseframes */
+	int bulk;					/* Offline transcription, audio is not paced */
+	int priority;				/* enum e_priority */
+	struct sphinx_sockprofile sock;	/* Socket options for this session */
+	struct sphinx_backend *backend;	/* Server we are connected to */
+	struct sphinx_fe fe;		/* Front end, when we send features */
+	char *partial;				/* Latest partial hypothesis */
+	int partialend;				/* It ends in a grammar end state */
+	int partialshown;			/* speech->results holds a partial, not a final result */
+	int stablefor;				/* Audio ms the partial has been unchanged in an end state */
+	int stablefinish;			/* Per-session stablefinish, 0 for off */
+	char grammar[64];			/* Last grammar activated, for learned endpoints */
+	char grammars[SPHINX_MAX_GRAMMARS][64];	/* Grammars the server listens for */
+	int ngrammars;				/* How many of them */
+	int silenceset;				/* silencetime was set for this session */
+	char *tunes;				/* Decoder settings made, "name=value" strings end to end */
+	int tuneslen;
+	int endpoint;				/* Silence that ends this utterance, ms */
+	int pause;					/* Length of the current pause after speech, ms */
+	int maxpause;				/* Longest pause speech resumed after, ms */
+	int speechms;				/* Audio since speech was detected, ms */
+	int deadline;				/* Audio an utterance may run to, ms; 0 for no limit */
+	int deadlinewait;			/* How long the final result may take after that, ms */
+	int uttms;					/* Audio in this utterance so far, ms */
+	int deadlined;				/* This utterance hit its deadline */
+	struct timeval deadline_tv;	/* When */
+	int storm;					/* Injected EAGAINs still to come */
+	int admitted;				/* Holds one of maxsessions */
+	int local;					/* Active grammar is decoded in-process */
+	struct sphinx_local_job *ljob;	/* Utterance queued for or on a local decoder */
+	int16_t *lbuf;				/* Utterance audio collected for the local decoder */
+	int lsamples;				/* How many samples are in lbuf */
+	int more;					/* Payload follows, send with MSG_MORE */
+	FILE *capture;				/* Wire capture file, owned by the capture writer */
+	struct timeval capture_tv;	/* Time of the last captured record */
+	unsigned int shadow;		/* Mirror id on the canary, 0 if not mirrored */
+	int shadowutt;				/* The canary has an utterance open */
+	struct timeval shadow_tv;	/* When the mirrored utterance was finished */
+	struct ast_speech *speech;	/* Owner, for the result notifier */
+	int efd;					/* eventfd signalled when final results land */
+	int notifying;				/* True while the notifier thread reads for us */
+	int published;				/* True once final results have been published */
+	struct timeval result_tv;	/* When the final results landed, until counted */
+	struct timeval notify_tv;	/* When the notifier took over */
+	AST_LIST_ENTRY(sphinx_state) notify_entry;
+};
+
+/*! \brief Per-engine result delivery latency, response arrival to sphinx_get() */
+struct sphinx_latency_stats {
+	int results;				/* Final results handed to the dialplan */
+	int total_ms;				/* Sum of their latencies */
+	int max_ms;					/* Worst latency seen */
+	int early;					/* Utterances ended on a stable partial */
+	int deadlines;				/* Utterances cut off at their deadline */
+	int abandoned;				/* Of those, ones whose final result never came */
+};
+
+/*! \brief Histogram buckets of SPHINX_PAUSE_BUCKET ms for learned endpoints */
+#define SPHINX_PAUSE_BUCKETS 100
+#define SPHINX_PAUSE_BUCKET  20
+
+/*! \brief Per-grammar pause statistics from utterances that ended on silence */
+struct sphinx_endpoint_stats {
+	char grammar[64];
+	int utterances;				/* Utterances learned from */
+	long long speech_ms;		/* Their total length, final silence excluded */
+	int hist[SPHINX_PAUSE_BUCKETS];	/* Longest pause inside each utterance */
+	int endpoint;				/* Learned silence timeout, 0 until there is enough data */
+	AST_LIST_ENTRY(sphinx_endpoint_stats) list;
+};
+
+/*! \brief
+ *
+ * What to do when the send buffer cannot take another request because the
+ * server is reading slower than we produce audio.
+ *
+ */
+enum e_overload {
+	SPHINX_OVERLOAD_FAIL,		/* Give up on the session (historical behaviour) */
+	SPHINX_OVERLOAD_BLOCK,		/* Wait up to overloadwait ms for the socket to drain */
+	SPHINX_OVERLOAD_DROP,		/* Shed the oldest queued silent frames */
+	SPHINX_OVERLOAD_FINISH		/* End the utterance early and take what we have */
+};
+
+/*! \brief
+ * Session priority classes.  Where sessions queue for something shared, a
+ * session slot or a local decoder, interactive ones go first and batch ones
+ * take a turn in every priorityweight + 1 while both are waiting.
+ */
+enum e_priority {
+	SPHINX_PRIO_INTERACTIVE,	/* Callers waiting on a prompt */
+	SPHINX_PRIO_BATCH,			/* Transcription and other offline work */
+	SPHINX_PRIO_CLASSES
+};
+
+/*! \brief Per-engine overload counters */
+struct sphinx_overload_stats {
+	int blocked;				/* Requests that had to wait for room */
+	int timeouts;				/* Waits that ran out of time */
+	int dropped;				/* Silent frames shed */
+	int finished;				/* Utterances ended early */
+	int failed;					/* Sessions lost to overflow */
 };
 
 /*! \brief
@@ -163,9 +440,104 @@ enum e_reqtype {
 	REQTYPE_GRAMMAR,
 	REQTYPE_START,
 	REQTYPE_DATA,
-	REQTYPE_FINISH
+	REQTYPE_FINISH,
+	REQTYPE_HELLO,
+	REQTYPE_CANCEL,
+	REQTYPE_TUNE
+};
+
+/*! \brief
+ *
+ * Protocol negotiation.  When enabled, the first request on a connection is a
+ * REQTYPE_HELLO, still in legacy framing so an old server can answer it, whose
+ * payload is four little-endian uint32: SPHINX_PROTO_MAGIC, our highest
+ * version, the byte order of the audio samples we send and our capability bits.
+ * A server that understands it answers with magic, the version to use and the
+ * capabilities it shares with us.  Anything else means legacy framing.
+ *
+ * Version 1 framing is fixed-width little-endian: requests carry uint32 length,
+ * type and utterance sequence; responses carry uint32 length, type and sequence.
+ *
+ */
+#define SPHINX_PROTO_MAGIC   0x58485053	/* "SPHX" */
+#define SPHINX_PROTO_VERSION 1
+
+#define SPHINX_ORDER_LITTLE  1
+#define SPHINX_ORDER_BIG     2
+
+#define SPHINX_CAP_COMPRESS  (1 << 0)	/* Compressed audio payloads */
+#define SPHINX_CAP_MULTIPLEX (1 << 1)	/* Several sessions per connection */
+#define SPHINX_CAP_BATCH     (1 << 2)	/* Several frames per DATA request */
+#define SPHINX_CAP_NBEST     (1 << 3)	/* N-best lists in results */
+#define SPHINX_CAP_CANCEL    (1 << 4)	/* REQTYPE_CANCEL, which gets no response */
+#define SPHINX_CAP_TUNE      (1 << 5)	/* REQTYPE_TUNE, "name=value" decoder settings */
+#define SPHINX_CAP_FEATURES  (1 << 6)	/* DATA carries cepstra, see SPHINX_FE_* */
+#define SPHINX_CAP_PARTIAL   (1 << 7)	/* RESPTYPE_PARTIAL answers to DATA */
+#define SPHINX_CAP_MULTIGRAMMAR (1 << 8)	/* GRAMMAR names a set, results name the winner */
+#define SPHINX_CAP_DATAGRAM  (1 << 9)	/* Audio by UDP, see SPHINX_DGRAM_HDR */
+
+/*! \brief Capabilities this client implements and will advertise */
+#define SPHINX_CLIENT_CAPS   (SPHINX_CAP_CANCEL | SPHINX_CAP_TUNE | SPHINX_CAP_PARTIAL | \
+							  SPHINX_CAP_MULTIGRAMMAR)
+
+#define SPHINX_REQHDR_V1     12
+#define SPHINX_RESPHDR_V1    12
+
+/*! \brief
+ *
+ * Wire capture files: SPHINX_CAPTURE_MAGIC, then one record per request or
+ * response, each a direction byte, little-endian uint64 microseconds since
+ * the previous record that was written, then little-endian uint32 type,
+ * sequence and payload length, then the payload exactly as it went over the
+ * socket.  SPHINX_CAPTURE_MAGIC1 files are the same with a uint32 delta,
+ * which wraps after 71 minutes; replay still reads them.
+ *
+ */
+#define SPHINX_CAPTURE_MAGIC    "SPHXCAP2"
+#define SPHINX_CAPTURE_MAGIC1   "SPHXCAP1"
+#define SPHINX_CAPTURE_REQUEST  0
+#define SPHINX_CAPTURE_RESPONSE 1
+#define SPHINX_CAPTURE_RECHDR   21
+#define SPHINX_CAPTURE_RECHDR1  17
+
+/*! \brief Response types in version 1 framing */
+enum e_resptype {
+	RESPTYPE_RESULT,
+	RESPTYPE_HELLO,
+	RESPTYPE_ACK,
+	RESPTYPE_PARTIAL			/* int32 score, uint32 SPHINX_PARTIAL_* flags, text so far */
 };
 
+/*! \brief
+ *
+ * With SPHINX_CAP_MULTIGRAMMAR, a REQTYPE_GRAMMAR payload is every active
+ * grammar name, each NUL terminated, and result and partial payloads carry the
+ * NUL terminated name of the grammar the text came from just before the text.
+ * With one grammar the payload is what legacy servers have always taken.
+ *
+ */
+
+/*! \brief
+ *
+ * With SPHINX_CAP_DATAGRAM the HELLO answer goes on with two more uint32: the
+ * UDP port the server takes audio on and a token naming this connection.
+ * Non-empty DATA requests then go to that port, each datagram on its own:
+ * little-endian uint32 token, utterance sequence, frame number within the
+ * utterance and the frame's audio time in ms from the start of the utterance,
+ * then at most SPHINX_DGRAM_MAX bytes of payload.  They get no response, so
+ * no partial results either.  The utterance ends with a REQTYPE_FINISH on the
+ * stream whose payload is the uint32 number of frames sent, so the server
+ * knows what to wait for; it holds frames for an utterance the stream has not
+ * reached yet, and conceals or skips the ones lost or too late.  Everything
+ * else, and every response, stays on the stream.
+ *
+ */
+#define SPHINX_DGRAM_HDR 16
+#define SPHINX_DGRAM_MAX 1040		/* A whole number of samples and of cepstral frames */
+
+/*! \brief The partial hypothesis ends in a grammar end state */
+#define SPHINX_PARTIAL_ENDSTATE (1 << 0)
+
 /*! \brief
  *
  * The packet we send to the Sphinx server
@@ -175,6 +547,7 @@ struct sphinx_request {
 	int dlen;
 	enum e_reqtype rtype;
 	char *data;
+	int silent;					/* Not sent; DATA frame holds no speech and may be shed */
 };
 
 #endif /* _ASTERISK_SPEECH_SPHINX_H */